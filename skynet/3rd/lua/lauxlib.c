@@ -1020,71 +1020,130 @@ LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
 
 // use clonefunction
 
-#include "spinlock.h"
+#include <sys/stat.h>
+#include "atomic.h"
+
+#define CACHE_HASH 1024
+
+// The entries are immutable after they are published, and never freed (the proto is never freed either),
+// so load() can walk the list without lock. A newer entry of the same file is pushed before the older one.
+struct cache_entry {
+  struct cache_entry *next;
+  unsigned hash;
+  time_t mtime;
+  off_t fsize;
+  const void *proto;
+  size_t size;  /* memory of the loaded chunk, kept by the cache */
+  char key[1];
+};
 
 struct codecache {
-	struct spinlock lock;
-	lua_State *L;
+  struct cache_entry *bucket[CACHE_HASH];
+  size_t hit;
+  size_t miss;
+  size_t reload;  /* miss because the file is changed */
+  size_t entries;
+  size_t size;
+  size_t cloned;  /* size of the entries hit: the chunks cloned instead of parsed, each clone allocates its own Proto */
 };
 
 static struct codecache CC;
 
-static void
-clearcache() {
-	if (CC.L == NULL)
-		return;
-	SPIN_LOCK(&CC)
-		lua_close(CC.L);
-		CC.L = luaL_newstate();
-	SPIN_UNLOCK(&CC)
+static unsigned
+cache_hash(const char *key) {
+  unsigned h = 2166136261u;
+  for (; *key; key++) {
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  }
+  return h;
+}
+
+static int
+file_version(const char *filename, time_t *mtime, off_t *fsize) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return 0;
+  }
+  *mtime = st.st_mtime;
+  *fsize = st.st_size;
+  return 1;
+}
+
+static struct cache_entry *
+find(struct cache_entry *e, const char *key, unsigned h) {
+  for (; e; e = e->next) {
+    if (e->hash == h && strcmp(e->key, key) == 0) {
+      return e;
+    }
+  }
+  return NULL;
 }
 
 static void
-init() {
-	SPIN_INIT(&CC);
-	CC.L = luaL_newstate();
+clearcache() {
+  int i;
+  for (i=0;i<CACHE_HASH;i++) {
+    struct cache_entry *e = __atomic_exchange_n(&CC.bucket[i], NULL, __ATOMIC_ACQ_REL);
+    /* the entries may be read by other threads now, notice: memory leak */
+    for (; e; e = e->next) {
+      ATOM_SUB(&CC.entries, 1);
+      ATOM_SUB(&CC.size, e->size);
+    }
+  }
 }
 
 static const void *
-load(const char *key) {
-  if (CC.L == NULL)
+load(const char *key, time_t mtime, off_t fsize) {
+  unsigned h = cache_hash(key);
+  struct cache_entry *e = find(__atomic_load_n(&CC.bucket[h % CACHE_HASH], __ATOMIC_ACQUIRE), key, h);
+  if (e == NULL) {
+    ATOM_INC(&CC.miss);
     return NULL;
-  SPIN_LOCK(&CC)
-    lua_State *L = CC.L;
-    lua_pushstring(L, key);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    const void * result = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-  SPIN_UNLOCK(&CC)
-
-  return result;
+  }
+  if (e->mtime != mtime || e->fsize != fsize) {
+    ATOM_INC(&CC.miss);
+    ATOM_INC(&CC.reload);
+    return NULL;
+  }
+  ATOM_INC(&CC.hit);
+  ATOM_ADD(&CC.cloned, e->size);
+  return e->proto;
 }
 
 static const void *
-save(const char *key, const void * proto) {
-  lua_State *L;
-  const void * result = NULL;
-
-  SPIN_LOCK(&CC)
-    if (CC.L == NULL) {
-      init();
-      L = CC.L;
-    } else {
-      L = CC.L;
-      lua_pushstring(L, key);
-      lua_pushvalue(L, -1);
-      lua_rawget(L, LUA_REGISTRYINDEX);
-      result = lua_touserdata(L, -1); /* stack: key oldvalue */
-      if (result == NULL) {
-        lua_pop(L,1);
-        lua_pushlightuserdata(L, (void *)proto);
-        lua_rawset(L, LUA_REGISTRYINDEX);
-      } else {
-        lua_pop(L,2);
-      }
+save(const char *key, time_t mtime, off_t fsize, const void * proto, size_t size) {
+  unsigned h = cache_hash(key);
+  struct cache_entry **bucket = &CC.bucket[h % CACHE_HASH];
+  size_t sz = strlen(key);
+  struct cache_entry *n = malloc(sizeof(*n) + sz);
+  if (n == NULL)
+    return NULL;
+  n->hash = h;
+  n->mtime = mtime;
+  n->fsize = fsize;
+  n->proto = proto;
+  n->size = size;
+  memcpy(n->key, key, sz+1);
+  for (;;) {
+    struct cache_entry *head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    struct cache_entry *e = find(head, key, h);
+    if (e && e->mtime == mtime && e->fsize == fsize) {
+      /* saved by another thread */
+      free(n);
+      return e->proto;
     }
-  SPIN_UNLOCK(&CC)
-  return result;
+    n->next = head;
+    if (ATOM_CAS_POINTER(bucket, head, n))
+      break;
+  }
+  ATOM_INC(&CC.entries);
+  ATOM_ADD(&CC.size, size);
+  return NULL;
+}
+
+static size_t
+memory_used(lua_State *L) {
+  return (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
 }
 
 #define CACHE_OFF 0
@@ -1132,10 +1191,12 @@ static int cache_mode(lua_State *L) {
 LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
                                              const char *mode) {
   int level = cache_level(L);
-  if (level == CACHE_OFF) {
+  time_t mtime;
+  off_t fsize;
+  if (level == CACHE_OFF || filename == NULL || !file_version(filename, &mtime, &fsize)) {
     return luaL_loadfilex_(L, filename, mode);
   }
-  const void * proto = load(filename);
+  const void * proto = load(filename, mtime, fsize);
   if (proto) {
     lua_clonefunction(L, proto);
     return LUA_OK;
@@ -1148,6 +1209,8 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
     lua_pushliteral(L, "New state failed");
     return LUA_ERRMEM;
   }
+  lua_gc(eL, LUA_GCCOLLECT, 0);
+  size_t base = memory_used(eL);
   int err = luaL_loadfilex_(eL, filename, mode);
   if (err != LUA_OK) {
     size_t sz = 0;
@@ -1157,7 +1220,8 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
     return err;
   }
   proto = lua_topointer(eL, -1);
-  const void * oldv = save(filename, proto);
+  lua_gc(eL, LUA_GCCOLLECT, 0);
+  const void * oldv = save(filename, mtime, fsize, proto, memory_used(eL) - base);
   if (oldv) {
     lua_close(eL);
     lua_clonefunction(L, oldv);
@@ -1176,10 +1240,29 @@ cache_clear(lua_State *L) {
 	return 0;
 }
 
+static int
+cache_stat(lua_State *L) {
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, CC.hit);
+	lua_setfield(L, -2, "hit");
+	lua_pushinteger(L, CC.miss);
+	lua_setfield(L, -2, "miss");
+	lua_pushinteger(L, CC.reload);
+	lua_setfield(L, -2, "reload");
+	lua_pushinteger(L, CC.entries);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, CC.size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, CC.cloned);
+	lua_setfield(L, -2, "cloned");
+	return 1;
+}
+
 LUAMOD_API int luaopen_cache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cache_clear },
 		{ "mode", cache_mode },
+		{ "stat", cache_stat },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
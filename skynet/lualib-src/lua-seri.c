@@ -28,82 +28,84 @@
 // hibits 0~31 : len
 #define TYPE_LONG_STRING 5
 #define TYPE_TABLE 6
+#define TYPE_STRING_REF 7
+// hibits 0~30 : the index of a short string appeared before in the message, 31 : the index is in the next byte
 
 #define MAX_COOKIE 32
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)
 
-#define BLOCK_SIZE 128
+#define MIN_BUFFER 64
+#define MIN_ARENA 4096
+#define MAX_ARENA 0x100000
 #define MAX_DEPTH 32
-
-struct block {
-	struct block * next;
-	char buffer[BLOCK_SIZE];
+// Every short string (2 <= len < MAX_COOKIE) gets an index in order, until MAX_STRING_REF.
+// It's the same rule for packref and unpack, so the index needn't be in the stream.
+#define MIN_STRING_REF 2
+#define MAX_STRING_REF 256
+#define STRING_REF_HASH (MAX_STRING_REF * 2)
+
+struct string_ref {
+	int n;
+	struct {
+		int offset;	// of the string in write_block buffer, -1 : empty slot
+		int index;
+	} slot[STRING_REF_HASH];
 };
 
 struct write_block {
-	struct block * head;
-	struct block * current;
+	uint8_t * buffer;
 	int len;
-	int ptr;
+	int cap;
+	struct string_ref * ref;	// NULL : don't pack references
 };
 
 struct read_block {
 	char * buffer;
 	int len;
 	int ptr;
+	int ref_n;
+	const char * ref[MAX_STRING_REF];
 };
 
-inline static struct block *
-blk_alloc(void) {
-	struct block *b = skynet_malloc(sizeof(struct block));
-	b->next = NULL;
-	return b;
+// The size of the last message packed by this thread, the initial size of the next one.
+static __thread int PACK_HINT = 0;
+// The scratch buffer of packstring reused by this thread, it's never freed (at most MAX_ARENA bytes per thread).
+static __thread uint8_t * ARENA = NULL;
+static __thread int ARENA_CAP = 0;
+
+static void
+wb_expand(struct write_block *b, int sz) {
+	int cap = b->cap * 2;
+	while (cap < b->len + sz) {
+		cap *= 2;
+	}
+	b->buffer = skynet_realloc(b->buffer, cap);
+	b->cap = cap;
 }
 
 inline static void
 wb_push(struct write_block *b, const void *buf, int sz) {
-	const char * buffer = buf;
-	if (b->ptr == BLOCK_SIZE) {
-_again:
-		b->current = b->current->next = blk_alloc();
-		b->ptr = 0;
-	}
-	if (b->ptr <= BLOCK_SIZE - sz) {
-		memcpy(b->current->buffer + b->ptr, buffer, sz);
-		b->ptr+=sz;
-		b->len+=sz;
-	} else {
-		int copy = BLOCK_SIZE - b->ptr;
-		memcpy(b->current->buffer + b->ptr, buffer, copy);
-		buffer += copy;
-		b->len += copy;
-		sz -= copy;
-		goto _again;
+	if (b->len + sz > b->cap) {
+		wb_expand(b, sz);
 	}
+	memcpy(b->buffer + b->len, buf, sz);
+	b->len += sz;
 }
 
 static void
-wb_init(struct write_block *wb , struct block *b) {
-	wb->head = b;
-	assert(b->next == NULL);
+wb_init(struct write_block *wb , uint8_t *buffer, int cap) {
+	wb->buffer = buffer;
 	wb->len = 0;
-	wb->current = wb->head;
-	wb->ptr = 0;
+	wb->cap = cap;
+	wb->ref = NULL;
 }
 
 static void
 wb_free(struct write_block *wb) {
-	struct block *blk = wb->head;
-	blk = blk->next;	// the first block is on stack
-	while (blk) {
-		struct block * next = blk->next;
-		skynet_free(blk);
-		blk = next;
-	}
-	wb->head = NULL;
-	wb->current = NULL;
-	wb->ptr = 0;
+	skynet_free(wb->buffer);
+	wb->buffer = NULL;
 	wb->len = 0;
+	wb->cap = 0;
 }
 
 static void
@@ -111,6 +113,7 @@ rball_init(struct read_block * rb, char * buffer, int size) {
 	rb->buffer = buffer;
 	rb->len = size;
 	rb->ptr = 0;
+	rb->ref_n = 0;
 }
 
 static void *
@@ -185,8 +188,59 @@ wb_pointer(struct write_block *wb, void *v) {
 	wb_push(wb, &v, sizeof(v));
 }
 
+static void
+ref_init(struct string_ref *ref) {
+	int i;
+	ref->n = 0;
+	for (i=0;i<STRING_REF_HASH;i++) {
+		ref->slot[i].offset = -1;
+	}
+}
+
+// Find the short string packed before, or add it (it will be at the offset of buffer).
+// Return the index of the string found, or -1.
+static int
+ref_string(struct write_block *wb, const char *str, int len) {
+	struct string_ref *ref = wb->ref;
+	uint32_t h = 2166136261u ^ len;
+	int i;
+	for (i=0;i<len;i++) {
+		h = (h ^ (uint8_t)str[i]) * 16777619u;
+	}
+	int pos = h % STRING_REF_HASH;
+	for (;;) {
+		int offset = ref->slot[pos].offset;
+		if (offset < 0) {
+			break;
+		}
+		// compare the bytes in the buffer, the str pointer may be a temporary string of __pairs
+		if (wb->buffer[offset-1] == COMBINE_TYPE(TYPE_SHORT_STRING, len) && memcmp(wb->buffer + offset, str, len) == 0) {
+			return ref->slot[pos].index;
+		}
+		pos = (pos + 1) % STRING_REF_HASH;
+	}
+	if (ref->n < MAX_STRING_REF) {
+		ref->slot[pos].offset = wb->len + 1;	// after the type byte
+		ref->slot[pos].index = ref->n++;
+	}
+	return -1;
+}
+
 static inline void
 wb_string(struct write_block *wb, const char *str, int len) {
+	if (wb->ref && len >= MIN_STRING_REF && len < MAX_COOKIE) {
+		int index = ref_string(wb, str, len);
+		if (index >= 0) {
+			if (index < MAX_COOKIE-1) {
+				uint8_t n = COMBINE_TYPE(TYPE_STRING_REF, index);
+				wb_push(wb, &n, 1);
+			} else {
+				uint8_t n[2] = { COMBINE_TYPE(TYPE_STRING_REF, MAX_COOKIE-1), (uint8_t)index };
+				wb_push(wb, n, 2);
+			}
+			return;
+		}
+	}
 	if (len < MAX_COOKIE) {
 		uint8_t n = COMBINE_TYPE(TYPE_SHORT_STRING, len);
 		wb_push(wb, &n, 1);
@@ -427,6 +481,36 @@ get_buffer(lua_State *L, struct read_block *rb, int len) {
 	lua_pushlstring(L,p,len);
 }
 
+static void
+get_short_string(lua_State *L, struct read_block *rb, int len) {
+	char * p = rb_read(rb,len);
+	if (p == NULL) {
+		invalid_stream(L,rb);
+	}
+	if (len >= MIN_STRING_REF && rb->ref_n < MAX_STRING_REF) {
+		// the length is in the type byte before the string
+		rb->ref[rb->ref_n++] = p;
+	}
+	lua_pushlstring(L,p,len);
+}
+
+static void
+get_string_ref(lua_State *L, struct read_block *rb, int cookie) {
+	int index = cookie;
+	if (cookie == MAX_COOKIE-1) {
+		uint8_t *p = rb_read(rb, 1);
+		if (p == NULL) {
+			invalid_stream(L,rb);
+		}
+		index = *p;
+	}
+	if (index >= rb->ref_n) {
+		invalid_stream(L,rb);
+	}
+	const char * str = rb->ref[index];
+	lua_pushlstring(L, str, (uint8_t)str[-1] >> 3);
+}
+
 static void unpack_one(lua_State *L, struct read_block *rb);
 
 static void
@@ -482,7 +566,10 @@ push_value(lua_State *L, struct read_block *rb, int type, int cookie) {
 		lua_pushlightuserdata(L,get_pointer(L,rb));
 		break;
 	case TYPE_SHORT_STRING:
-		get_buffer(L,rb,cookie);
+		get_short_string(L,rb,cookie);
+		break;
+	case TYPE_STRING_REF:
+		get_string_ref(L,rb,cookie);
 		break;
 	case TYPE_LONG_STRING: {
 		if (cookie == 2) {
@@ -529,27 +616,6 @@ unpack_one(lua_State *L, struct read_block *rb) {
 	push_value(L, rb, type & 0x7, type>>3);
 }
 
-static void
-seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);
-	uint8_t * ptr = buffer;
-	int sz = len;
-	while(len>0) {
-		if (len >= BLOCK_SIZE) {
-			memcpy(ptr, b->buffer, BLOCK_SIZE);
-			ptr += BLOCK_SIZE;
-			len -= BLOCK_SIZE;
-			b = b->next;
-		} else {
-			memcpy(ptr, b->buffer, len);
-			break;
-		}
-	}
-	
-	lua_pushlightuserdata(L, buffer);
-	lua_pushinteger(L, sz);
-}
-
 int
 _luaseri_unpack(lua_State *L) {
 	if (lua_isnoneornil(L,1)) {
@@ -594,17 +660,65 @@ _luaseri_unpack(lua_State *L) {
 	return lua_gettop(L);
 }
 
-int
-_luaseri_pack(lua_State *L) {
-	struct block temp;
-	temp.next = NULL;
+// Pack into the message buffer directly, the buffer is sized by the last message of this thread.
+static int
+pack_message(lua_State *L, struct string_ref *ref) {
+	int cap = PACK_HINT + PACK_HINT / 4;
+	if (cap < MIN_BUFFER) {
+		cap = MIN_BUFFER;
+	}
 	struct write_block wb;
-	wb_init(&wb, &temp);
+	wb_init(&wb, skynet_malloc(cap), cap);
+	wb.ref = ref;
 	pack_from(L,&wb,0);
-	assert(wb.head == &temp);
-	seri(L, &temp, wb.len);
+	PACK_HINT = wb.len;
+	if (wb.cap > MIN_BUFFER && wb.cap > wb.len * 2) {
+		// the hint is too large, don't keep the slack for the message lifetime
+		wb.buffer = skynet_realloc(wb.buffer, wb.len > 0 ? wb.len : 1);
+	}
 
-	wb_free(&wb);
+	lua_pushlightuserdata(L, wb.buffer);
+	lua_pushinteger(L, wb.len);
 
 	return 2;
 }
+
+int
+_luaseri_pack(lua_State *L) {
+	return pack_message(L, NULL);
+}
+
+// Pack the repeated short strings (table keys, etc) as references.
+// The message can only be unpacked by the nodes support TYPE_STRING_REF.
+int
+_luaseri_packref(lua_State *L) {
+	struct string_ref ref;
+	ref_init(&ref);
+	return pack_message(L, &ref);
+}
+
+// Pack into the scratch buffer of this thread, and return a string.
+int
+_luaseri_packstring(lua_State *L) {
+	uint8_t * buffer = ARENA;
+	int cap = ARENA_CAP;
+	// detach the scratch buffer, so a __pairs metamethod calling packstring uses another one
+	ARENA = NULL;
+	ARENA_CAP = 0;
+	if (buffer == NULL) {
+		cap = MIN_ARENA;
+		buffer = skynet_malloc(cap);
+	}
+	struct write_block wb;
+	wb_init(&wb, buffer, cap);
+	pack_from(L,&wb,0);
+	lua_pushlstring(L, (const char *)wb.buffer, wb.len);
+	if (ARENA == NULL && wb.cap <= MAX_ARENA) {
+		ARENA = wb.buffer;
+		ARENA_CAP = wb.cap;
+	} else {
+		skynet_free(wb.buffer);
+	}
+
+	return 1;
+}
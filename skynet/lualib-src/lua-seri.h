@@ -5,5 +5,7 @@
 
 int _luaseri_pack(lua_State *L);
 int _luaseri_unpack(lua_State *L);
+int _luaseri_packstring(lua_State *L);
+int _luaseri_packref(lua_State *L);
 
 #endif
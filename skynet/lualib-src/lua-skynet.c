@@ -1,4 +1,5 @@
 #include "skynet.h"
+#include "skynet_handle.h"
 #include "lua-seri.h"
 
 #define KNRM  "\x1B[0m"
@@ -136,10 +137,16 @@ _intcommand(lua_State *L) {
 	const char * parm = NULL;
 	char tmp[64];	// for integer parm
 	if (lua_gettop(L) == 2) {
-	  -- only different with _command is that the 2nd argument is integer if exist
-	  -- print the integer argument to string
-		int32_t n = (int32_t)luaL_checkinteger(L,2);
-		sprintf(tmp, "%d", n);
+	  // only different with _command is that the 2nd argument is integer if exist
+	  // print the integer argument to string
+		if (lua_isinteger(L, 2)) {
+			int32_t n = (int32_t)lua_tointeger(L,2);
+			sprintf(tmp, "%d", n);
+		} else {
+			// fraction, TIMEOUT accepts it
+			lua_Number n = luaL_checknumber(L,2);
+			snprintf(tmp, sizeof(tmp), "%f", (double)n);
+		}
 		parm = tmp;
 	}
 
@@ -169,6 +176,35 @@ get_dest_string(lua_State *L, int index) {
 	return dest_string;
 }
 
+// Resolve ".name" with the cache (the upvalue 2 of _send) : name -> handle, cache[0] is the version.
+// The cache is dropped when any name is removed (skynet_handle_nameversion changes).
+static uint32_t
+query_name(lua_State *L, int index, const char * name) {
+	uint32_t version = skynet_handle_nameversion();
+	lua_rawgeti(L, lua_upvalueindex(2), 0);
+	if (lua_tointeger(L, -1) != version) {
+		lua_createtable(L, 0, 1);
+		lua_pushinteger(L, version);
+		lua_rawseti(L, -2, 0);
+		lua_replace(L, lua_upvalueindex(2));
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, index);
+	if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TNUMBER) {
+		uint32_t handle = (uint32_t)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		return handle;
+	}
+	lua_pop(L, 1);
+	uint32_t handle = skynet_handle_findname(name + 1);
+	if (handle) {
+		lua_pushvalue(L, index);
+		lua_pushinteger(L, handle);
+		lua_rawset(L, lua_upvalueindex(2));
+	}
+	return handle;
+}
+
 /*
 	uint32 address
 	 string address
@@ -192,6 +228,13 @@ _send(lua_State *L) {
 	  // if the 1st argument is not integer, then it is string
 	  // dest_string = ".launcher" for example
 		dest_string = get_dest_string(L, 1);
+		if (dest_string[0] == '.') {
+			// local name, resolve it without skynet_sendname
+			dest = query_name(L, 1, dest_string);
+			if (dest) {
+				dest_string = NULL;
+			}
+		}
 	}
   // ensure the 2nd argument is a integer, type = PTYPE_LUA for example
 	int type = luaL_checkinteger(L, 2);
@@ -321,16 +364,6 @@ _harbor(lua_State *L) {
 	return 2;
 }
 
-static int
-lpackstring(lua_State *L) {
-	_luaseri_pack(L);
-	char * str = (char *)lua_touserdata(L, -2);
-	int sz = lua_tointeger(L, -1);
-	lua_pushlstring(L, str, sz);
-	skynet_free(str);
-	return 1;
-}
-
 static int
 ltrash(lua_State *L) {
 	int t = lua_type(L,1);
@@ -366,7 +399,8 @@ luaopen_skynet_core(lua_State *L) {
 		{ "harbor", _harbor },
 		{ "pack", _luaseri_pack },
 		{ "unpack", _luaseri_unpack },
-		{ "packstring", lpackstring },
+		{ "packstring", _luaseri_packstring },
+		{ "packref", _luaseri_packref },
 		{ "trash" , ltrash },
 		{ "callback", _callback },
 		{ NULL, NULL },
@@ -382,5 +416,11 @@ luaopen_skynet_core(lua_State *L) {
 
 	luaL_setfuncs(L,l,1);
 
+	// the name cache of _send, see query_name
+	lua_pushlightuserdata(L, ctx);
+	lua_newtable(L);
+	lua_pushcclosure(L, _send, 2);
+	lua_setfield(L, -2, "send");
+
 	return 1;
 }
@@ -40,7 +40,7 @@ lfreepool(lua_State *L) {
 	for (i=0;i<sz;i++) {
 		struct buffer_node *node = &pool[i];
 		if (node->msg) {
-			skynet_free(node->msg);
+			skynet_socket_free_buffer(node->msg);
 			node->msg = NULL;
 		}
 	}
@@ -154,7 +154,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	skynet_free(free_node->msg);
+	skynet_socket_free_buffer(free_node->msg);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
@@ -288,7 +288,7 @@ static int
 ldrop(lua_State *L) {
 	void * msg = lua_touserdata(L,1);
 	luaL_checkinteger(L,2);
-	skynet_free(msg);
+	skynet_socket_free_buffer(msg);
 	return 0;
 }
 
@@ -538,6 +538,37 @@ lnodelay(lua_State *L) {
 	return 0;
 }
 
+static int
+lflowcontrol(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int high = luaL_checkinteger(L, 1);
+	int low = luaL_optinteger(L, 2, -1);
+	skynet_socket_flowcontrol(ctx, high, low);
+	return 0;
+}
+
+static int
+llistenstat(lua_State *L) {
+	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int id = luaL_checkinteger(L, 1);
+	struct skynet_socket_listenstat stat;
+	if (skynet_socket_listenstat(ctx, id, &stat)) {
+		return 0;
+	}
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, (lua_Integer)stat.accepted);
+	lua_setfield(L, -2, "accepted");
+	lua_pushinteger(L, (lua_Integer)stat.dropped);
+	lua_setfield(L, -2, "dropped");
+	lua_pushinteger(L, stat.rate);
+	lua_setfield(L, -2, "rate");
+	lua_pushinteger(L, stat.backlog);
+	lua_setfield(L, -2, "backlog");
+	lua_pushinteger(L, stat.backlog_max);
+	lua_setfield(L, -2, "backlog_max");
+	return 1;
+}
+
 static int
 ludp(lua_State *L) {
 	struct skynet_context * ctx = lua_touserdata(L, lua_upvalueindex(1));
@@ -645,6 +676,8 @@ luaopen_socketdriver(lua_State *L) {
 		{ "bind", lbind },
 		{ "start", lstart },
 		{ "nodelay", lnodelay },
+		{ "flowcontrol", lflowcontrol },
+		{ "listenstat", llistenstat },
 		{ "udp", ludp },
 		{ "udp_connect", ludp_connect },
 		{ "udp_send", ludp_send },
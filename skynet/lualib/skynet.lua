@@ -122,7 +122,12 @@ local function dispatch_wakeup()
 		wakeup_session[co] = nil
 		local session = sleep_session[co]
 		if session then
-			session_id_coroutine[session] = "BREAK"
+			if c.intcommand("UNTIMEOUT", session) then
+				-- the timer is cancelled, no response will come
+				session_id_coroutine[session] = nil
+			else
+				session_id_coroutine[session] = "BREAK"
+			end
 			return suspend(co, coroutine.resume(co, false, "BREAK"))
 		end
 	end
@@ -248,12 +253,23 @@ function suspend(co, result, command, param, size)
 	dispatch_error_queue()
 end
 
+-- ti is centisecond, returns the session as the timer id for skynet.untimeout
 function skynet.timeout(ti, func)
 	local session = c.intcommand("TIMEOUT",ti)
 	assert(session)
 	local co = co_create(func)
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
+	return session
+end
+
+-- cancel the timer created by skynet.timeout, returns false if it fires already
+function skynet.untimeout(session)
+	if c.intcommand("UNTIMEOUT", session) then
+		session_id_coroutine[session] = nil
+		return true
+	end
+	return false
 end
 
 function skynet.sleep(ti)
@@ -363,6 +379,8 @@ end
 
 skynet.pack = assert(c.pack)
 skynet.packstring = assert(c.packstring)
+-- pack the repeated strings as references, the receiver should support it (skynet.unpack of this version)
+skynet.packref = assert(c.packref)
 skynet.unpack = assert(c.unpack)
 skynet.tostring = assert(c.tostring)
 skynet.trash = assert(c.trash)
@@ -642,6 +660,37 @@ function skynet.init_service(start)
 	end
 end
 
+-- Limit the memory of this service (bytes, 0 is unlimited), call it before the service starts (in main chunk).
+-- When the limit is reached, lua runs a full gc first, and then raises a "not enough memory" error.
+function skynet.memlimit(bytes)
+	debug.getregistry().memlimit = bytes
+	skynet.memlimit = nil	-- set only once
+end
+
+-- mode : "incremental" (pause, stepmul), or "generational" (minormul, majormul) if lua supports it.
+-- return the previous mode, or nil and the error message when the mode is not supported.
+function skynet.gcmode(mode, a, b)
+	if mode == "incremental" then
+		if _VERSION == "Lua 5.3" then
+			if a then
+				collectgarbage("setpause", a)
+			end
+			if b then
+				collectgarbage("setstepmul", b)
+			end
+			return "incremental"
+		end
+		return collectgarbage("incremental", a, b)
+	elseif mode == "generational" then
+		if _VERSION == "Lua 5.3" then
+			return nil, "generational gc is not supported by " .. _VERSION
+		end
+		return collectgarbage("generational", a, b)
+	else
+		error("Invalid gc mode " .. tostring(mode))
+	end
+end
+
 function skynet.start(start_func)
 	c.callback(skynet.dispatch_message)
 	skynet.timeout(0, function()
@@ -657,6 +706,13 @@ function skynet.mqlen()
 	return c.intcommand "MQLEN"
 end
 
+-- what : "count [ptype]", "wait percent|max", "exec percent|max" (in nanoseconds) or "reset"
+-- return nil if msgstat is disabled in config
+function skynet.stat(what)
+	local r = c.command("STAT", what)
+	return r and tonumber(r)
+end
+
 function skynet.task(ret)
 	local t = 0
 	for session,co in pairs(session_id_coroutine) do
@@ -29,6 +29,39 @@ function dbgcmd.STAT()
 	local stat = {}
 	stat.mqlen = skynet.mqlen()
 	stat.task = skynet.task()
+	local message = skynet.stat "count"
+	if message then
+		-- msgstat is enabled, in microseconds
+		stat.message = message
+		stat.wait99 = skynet.stat "wait 99" // 1000
+		stat.exec99 = skynet.stat "exec 99" // 1000
+	end
+	skynet.ret(skynet.pack(stat))
+end
+
+function dbgcmd.MSGSTAT(reset)
+	local stat = {}
+	if skynet.stat "count" then
+		stat.count = skynet.stat "count"
+		for k,v in pairs(skynet) do
+			local name = type(k) == "string" and k:match "^PTYPE_(.*)"
+			if name then
+				local n = skynet.stat("count " .. v)
+				if n > 0 then
+					stat["count." .. name:lower()] = n
+				end
+			end
+		end
+		-- in microseconds
+		for _, what in ipairs { "wait", "exec" } do
+			for _, p in ipairs { "50", "90", "99", "99.9", "max" } do
+				stat[what .. "." .. p] = skynet.stat(what .. " " .. p) / 1000
+			end
+		end
+		if reset then
+			skynet.stat "reset"
+		end
+	end
 	skynet.ret(skynet.pack(stat))
 end
 
@@ -37,6 +37,10 @@ function gateserver.start(handler)
 		local port = assert(conf.port)
 		maxclient = conf.maxclient or 1024
 		nodelay = conf.nodelay
+		if conf.flowhigh then
+			-- stop reading the clients when the queue of gate is longer than flowhigh
+			socketdriver.flowcontrol(conf.flowhigh, conf.flowlow)
+		end
 		skynet.error(string.format("Listen on %s:%d", address, port))
 		socket = socketdriver.listen(address, port)
 		socketdriver.start(socket)
@@ -2,8 +2,6 @@
 local driver = require "socketdriver"
 -- load "./lualib/skynet.lua"
 local skynet = require "skynet"
--- load luaopen_skynet_core in "./luaclib/skynet.so" <= "./lualib-src/lua-skynet.c"
-local skynet_core = require "skynet.core"
 local assert = assert
 
 local socket = {}	-- api
@@ -135,7 +133,7 @@ socket_message[6] = function(id, size, data, address)
 		return
 	end
 	local str = skynet.tostring(data, size)
-	skynet_core.trash(data, size)
+	driver.drop(data, size)
 	s.callback(str, address)
 end
 
@@ -398,6 +396,18 @@ function socket.limit(id, limit)
 	s.buffer_limit = limit
 end
 
+-- The counters of a listening socket : accepted, dropped (accepted but closed, or accept failed),
+-- rate (accepted in the last second), backlog and backlog_max (the accept queue, -1 if unknown)
+function socket.listenstat(id)
+	return driver.listenstat(id)
+end
+
+-- Pause reading the sockets which send data to this service when its message queue is longer than high,
+-- and resume them when it's not longer than low (default is high/2). socket.flowcontrol(0) turns it off.
+function socket.flowcontrol(high, low)
+	driver.flowcontrol(high, low)
+end
+
 ---------------------- UDP
 
 local udp_socket = {}
@@ -220,7 +220,7 @@ dispatch_socket_message(struct gate *g, const struct skynet_socket_message * mes
 		} else {
 			skynet_error(ctx, "Drop unknown connection %d message", message->id);
 			skynet_socket_close(ctx, message->id);
-			skynet_free(message->buffer);
+			skynet_socket_free_buffer(message->buffer);
 		}
 		break;
 	}
@@ -344,7 +344,9 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	char binding[sz];
 	int client_tag = 0;
 	char header;
-	int n = sscanf(parm, "%c %s %s %d %d", &header, watchdog, binding, &client_tag, &max);
+	int flow_high = 0;
+	int flow_low = -1;
+	int n = sscanf(parm, "%c %s %s %d %d %d %d", &header, watchdog, binding, &client_tag, &max, &flow_high, &flow_low);
 	if (n<4) {
 		skynet_error(ctx, "Invalid gate parm %s",parm);
 		return 1;
@@ -372,6 +374,9 @@ gate_init(struct gate *g , struct skynet_context * ctx, char * parm) {
 	}
 
 	g->ctx = ctx;
+	if (flow_high > 0) {
+		skynet_socket_flowcontrol(ctx, flow_high, flow_low);
+	}
 
 	hashid_init(&g->hash, max);
 	g->conn = skynet_malloc(max * sizeof(struct connection));
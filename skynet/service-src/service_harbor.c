@@ -411,7 +411,7 @@ push_socket_data(struct harbor *h, const struct skynet_socket_message * message)
 		}
 	}
 	if (s == NULL) {
-		skynet_free(message->buffer);
+		// the buffer is freed by mainloop
 		skynet_error(h->ctx, "Invalid socket fd (%d) data", fd);
 		return;
 	}
@@ -650,7 +650,7 @@ mainloop(struct skynet_context * context, void * ud, int type, int session, uint
 		switch(message->type) {
 		case SKYNET_SOCKET_TYPE_DATA:
 			push_socket_data(h, message);
-			skynet_free(message->buffer);
+			skynet_socket_free_buffer(message->buffer);
 			break;
 		case SKYNET_SOCKET_TYPE_ERROR:
 		case SKYNET_SOCKET_TYPE_CLOSE: {
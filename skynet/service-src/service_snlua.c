@@ -9,9 +9,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#define MEMORY_WARNING_REPORT (1024 * 1024 * 32)
+
 struct snlua {
 	lua_State * L;
 	struct skynet_context * ctx;
+	struct skynet_slab * slab;
+	size_t mem;
+	size_t mem_report;
+	size_t mem_limit;
 };
 
 // LUA_CACHELIB may defined in patched lua for shared proto
@@ -31,6 +37,7 @@ codecache(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "clear", cleardummy },
 		{ "mode", cleardummy },
+		{ "stat", cleardummy },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);
@@ -158,6 +165,16 @@ _init(struct snlua *l, struct skynet_context *ctx, const char * args, size_t sz)
   // clear the stack
 	lua_settop(L,0);
 
+  // the service may set its own memory limit by skynet.memlimit(bytes) before it starts
+	if (lua_getfield(L, LUA_REGISTRYINDEX, "memlimit") == LUA_TNUMBER) {
+		size_t limit = lua_tointeger(L, -1);
+		l->mem_limit = limit;
+		skynet_error(ctx, "Set memory limit to %.2f M", (float)limit / (1024 * 1024));
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "memlimit");
+	}
+	lua_pop(L, 1);
+
   // restart the gc
 	lua_gc(L, LUA_GCRESTART, 0);
 
@@ -209,18 +226,56 @@ snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
 	return 0;
 }
 
+static void *
+lalloc(void * ud, void *ptr, size_t osize, size_t nsize) {
+	struct snlua *l = ud;
+	size_t mem = l->mem;
+	if (ptr) {
+		mem -= osize;	// when ptr is NULL, osize is the type of the object
+	}
+	mem += nsize;
+	if (l->mem_limit != 0 && mem > l->mem_limit && nsize > (ptr ? osize : 0)) {
+		// lua runs an emergency full gc and tries again, then raises LUA_ERRMEM
+		return NULL;
+	}
+	void * r = l->slab ? skynet_slab_lalloc(l->slab, ptr, osize, nsize) : skynet_lalloc(NULL, ptr, osize, nsize);
+	if (r == NULL && nsize > 0) {
+		return NULL;
+	}
+	l->mem = mem;
+	if (mem > l->mem_report) {
+		l->mem_report *= 2;
+		skynet_error(l->ctx, "Memory warning %.2f M", (float)mem / (1024 * 1024));
+	}
+	return r;
+}
+
 struct snlua *
 snlua_create(void) {
   // create snlua and new a Lua State with it
 	struct snlua * l = skynet_malloc(sizeof(*l));
 	memset(l,0,sizeof(*l));
-	l->L = lua_newstate(skynet_lalloc, NULL);
+	l->mem_report = MEMORY_WARNING_REPORT;
+	// the default memory limit of lua services (bytes), 0 is unlimited. see skynet.memlimit
+	const char * limit = skynet_command(NULL, "GETENV", "memlimit");
+	if (limit) {
+		l->mem_limit = (size_t)strtod(limit, NULL);
+	}
+	const char * slab = skynet_command(NULL, "GETENV", "luaslab");
+	if (slab && strcmp(slab, "true") == 0) {
+		// small blocks of lua are allocated from the slabs owned by this service
+		l->slab = skynet_slab_new();
+	}
+	l->L = lua_newstate(lalloc, l);
 	return l;
 }
 
 void
 snlua_release(struct snlua *l) {
 	lua_close(l->L);
+	if (l->slab) {
+		skynet_slab_delete(l->slab);
+	}
 	skynet_free(l);
 }
 
@@ -123,6 +123,7 @@ function COMMAND.help()
 		start = "lanuch a new lua service",
 		snax = "lanuch a new snax service",
 		clearcache = "clear lua code cache",
+		cachestat = "show lua code cache hit/miss and the size of the chunks cloned",
 		service = "List unique service",
 		task = "task address : show service task detail",
 		inject = "inject address luascript.lua",
@@ -133,6 +134,7 @@ function COMMAND.help()
 		signal = "signal address sig",
 		cmem = "Show C memory info",
 		shrtbl = "Show shared short string table info",
+		msgstat = "msgstat address [reset] : show message wait/exec time (us) of a service, need msgstat = true in config",
 	}
 end
 
@@ -140,6 +142,10 @@ function COMMAND.clearcache()
 	codecache.clear()
 end
 
+function COMMAND.cachestat()
+	return codecache.stat()
+end
+
 function COMMAND.start(...)
 	local ok, addr = pcall(skynet.newservice, ...)
 	if ok then
@@ -219,6 +225,11 @@ function COMMAND.task(address)
 	return skynet.call(address,"debug","TASK")
 end
 
+function COMMAND.msgstat(address, reset)
+	address = adjust_address(address)
+	return skynet.call(address,"debug","MSGSTAT", reset == "reset")
+end
+
 function COMMAND.info(address)
 	address = adjust_address(address)
 	return skynet.call(address,"debug","INFO")
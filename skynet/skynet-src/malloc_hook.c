@@ -21,6 +21,13 @@ typedef struct _mem_data {
 static mem_data mem_stats[SLOT_SIZE];
 
 
+static void malloc_oom(size_t size) {
+	fprintf(stderr, "xmalloc: Out of memory trying to allocate %zu bytes\n",
+		size);
+	fflush(stderr);
+	abort();
+}
+
 #ifndef NOUSE_JEMALLOC
 
 #include "jemalloc.h"
@@ -87,13 +94,6 @@ clean_prefix(char* ptr) {
 	return ptr;
 }
 
-static void malloc_oom(size_t size) {
-	fprintf(stderr, "xmalloc: Out of memory trying to allocate %zu bytes\n",
-		size);
-	fflush(stderr);
-	abort();
-}
-
 void 
 memory_info_dump(void) {
 	je_malloc_stats_print(0,0,0);
@@ -227,6 +227,128 @@ skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
 	}
 }
 
+// Slab allocator for lua, see skynet_slab_lalloc
+
+#define SLAB_MAX 256
+#define SLAB_ALIGN 16
+#define SLAB_CLASS (SLAB_MAX / SLAB_ALIGN)
+#define SLAB_HEADER 16
+#define SLAB_CHUNK_MIN 0x1000
+#define SLAB_CHUNK_MAX 0x10000
+
+struct slab_chunk {
+	struct slab_chunk * next;
+};
+
+struct skynet_slab {
+	void * freelist[SLAB_CLASS];
+	char * ptr;
+	char * end;
+	struct slab_chunk * chunk;
+	size_t chunk_size;
+};
+
+struct skynet_slab *
+skynet_slab_new(void) {
+	struct skynet_slab * s = skynet_malloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->chunk_size = SLAB_CHUNK_MIN / 2;
+	return s;
+}
+
+void
+skynet_slab_delete(struct skynet_slab *s) {
+	struct slab_chunk * c = s->chunk;
+	while (c) {
+		struct slab_chunk * next = c->next;
+		skynet_free(c);
+		c = next;
+	}
+	skynet_free(s);
+}
+
+static inline int
+slab_class(size_t sz) {
+	return (int)((sz - 1) / SLAB_ALIGN);
+}
+
+static void *
+slab_alloc(struct skynet_slab *s, size_t nsize) {
+	int c = slab_class(nsize);
+	void ** p = s->freelist[c];
+	if (p) {
+		s->freelist[c] = *p;
+		return p;
+	}
+	size_t sz = (c + 1) * SLAB_ALIGN;
+	if (s->ptr + sz > s->end) {
+		// the rest of current chunk is wasted, it's less than SLAB_MAX
+		size_t chunk_size = s->chunk_size < SLAB_CHUNK_MAX ? s->chunk_size * 2 : SLAB_CHUNK_MAX;
+		struct slab_chunk * chunk = skynet_malloc(chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = s->chunk;
+		s->chunk = chunk;
+		s->chunk_size = chunk_size;
+		s->ptr = (char *)chunk + SLAB_HEADER;
+		s->end = (char *)chunk + chunk_size;
+	}
+	p = (void **)s->ptr;
+	s->ptr += sz;
+	return p;
+}
+
+static inline void
+slab_free(struct skynet_slab *s, void *ptr, size_t osize) {
+	int c = slab_class(osize);
+	*(void **)ptr = s->freelist[c];
+	s->freelist[c] = ptr;
+}
+
+// lua_Alloc for one lua_State (ud is struct skynet_slab *). The blocks <= SLAB_MAX are carved from chunks,
+// and reused by size class. The service runs on one thread at a time, so it needs no lock or atomic,
+// and only the chunks are counted in the memory of the service. The chunks are freed by skynet_slab_delete.
+void *
+skynet_slab_lalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct skynet_slab * s = ud;
+	if (ptr == NULL) {
+		osize = 0;	// osize is the type of the object
+	}
+	if (osize > SLAB_MAX && nsize > SLAB_MAX) {
+		return skynet_realloc(ptr, nsize);
+	}
+	if (nsize == 0) {
+		if (osize > SLAB_MAX) {
+			skynet_free(ptr);
+		} else if (ptr) {
+			slab_free(s, ptr, osize);
+		}
+		return NULL;
+	}
+	if (osize > 0 && osize <= SLAB_MAX && nsize <= SLAB_MAX && slab_class(osize) == slab_class(nsize)) {
+		return ptr;
+	}
+	void * np = nsize <= SLAB_MAX ? slab_alloc(s, nsize) : skynet_malloc(nsize);
+	if (np == NULL) {
+		if (nsize >= osize)
+			return NULL;
+		// lua assumes shrinking never fails. A slab block can be kept (it's freed by the class of nsize,
+		// which is not larger), but a heap block must never go to slab_free.
+		if (osize > SLAB_MAX)
+			malloc_oom(nsize);
+		return ptr;
+	}
+	if (ptr) {
+		memcpy(np, ptr, osize < nsize ? osize : nsize);
+		if (osize > SLAB_MAX) {
+			skynet_free(ptr);
+		} else {
+			slab_free(s, ptr, osize);
+		}
+	}
+	return np;
+}
+
 int
 dump_mem_lua(lua_State *L) {
 	int i;
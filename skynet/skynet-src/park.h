@@ -0,0 +1,95 @@
+#ifndef SKYNET_PARK_H
+#define SKYNET_PARK_H
+
+// Park/unpark a single thread.
+// Use futex on linux, and mutex with condition variable on other platforms.
+
+#if defined(__linux__) && !defined(USE_PTHREAD_LOCK)
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct park {
+	int signal;
+};
+
+static inline void
+park_init(struct park *p) {
+	p->signal = 0;
+}
+
+static inline void
+park_destroy(struct park *p) {
+	(void) p;
+}
+
+// call it before publishing the thread as parked
+static inline void
+park_reset(struct park *p) {
+	p->signal = 0;
+}
+
+static inline void
+park_wait(struct park *p) {
+	while (*(volatile int *)&p->signal == 0) {
+		syscall(SYS_futex, &p->signal, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+	}
+}
+
+static inline void
+park_unpark(struct park *p) {
+	__sync_lock_test_and_set(&p->signal, 1);
+	syscall(SYS_futex, &p->signal, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#else
+
+#include <pthread.h>
+
+struct park {
+	int signal;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static inline void
+park_init(struct park *p) {
+	p->signal = 0;
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+}
+
+static inline void
+park_destroy(struct park *p) {
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond);
+}
+
+static inline void
+park_reset(struct park *p) {
+	pthread_mutex_lock(&p->mutex);
+	p->signal = 0;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+static inline void
+park_wait(struct park *p) {
+	pthread_mutex_lock(&p->mutex);
+	while (p->signal == 0) {
+		pthread_cond_wait(&p->cond, &p->mutex);
+	}
+	pthread_mutex_unlock(&p->mutex);
+}
+
+static inline void
+park_unpark(struct park *p) {
+	pthread_mutex_lock(&p->mutex);
+	p->signal = 1;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+#include "skynet.h"
+
+#include "skynet_epoch.h"
+#include "spinlock.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each thread owns a record, which is linked in a list and never freed.
+// The record of an exited thread is reused by a new one.
+// A pointer retired at epoch e can be freed when the global epoch reaches e+2,
+// because the epoch advances only when no reader is active in an older epoch.
+
+#define DEFAULT_LIMBO 64
+
+struct epoch_record {
+	struct epoch_record *next;
+	uint64_t active;	// the epoch when enter, 0 means quiescent
+	int used;
+	int nest;
+};
+
+struct limbo {
+	void *ptr;
+	uint64_t epoch;
+};
+
+struct epoch_global {
+	uint64_t epoch;
+	struct epoch_record *record;
+	pthread_key_t key;
+	struct spinlock lock;	// for limbo
+	int limbo_n;
+	int limbo_cap;
+	struct limbo *limbo;
+};
+
+static struct epoch_global E;
+static __thread struct epoch_record *R = NULL;
+
+static void
+record_release(void *ud) {
+	struct epoch_record *r = ud;
+	r->nest = 0;
+	__atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static struct epoch_record *
+record_acquire(void) {
+	struct epoch_record *r;
+	for (r = E.record; r; r = r->next) {
+		if (r->used == 0 && __sync_bool_compare_and_swap(&r->used, 0, 1)) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		r = skynet_malloc(sizeof(*r));
+		memset(r, 0, sizeof(*r));
+		r->used = 1;
+		do {
+			r->next = E.record;
+		} while (!__sync_bool_compare_and_swap(&E.record, r->next, r));
+	}
+	pthread_setspecific(E.key, r);
+	return r;
+}
+
+void
+skynet_epoch_enter(void) {
+	struct epoch_record *r = R;
+	if (r == NULL) {
+		R = r = record_acquire();
+	}
+	if (r->nest++ > 0) {
+		return;
+	}
+	for (;;) {
+		uint64_t e = E.epoch;
+		r->active = e;
+		__sync_synchronize();
+		// the epoch may advance before the writer sees r->active, try again
+		if (__atomic_load_n(&E.epoch, __ATOMIC_ACQUIRE) == e) {
+			break;
+		}
+	}
+}
+
+void
+skynet_epoch_exit(void) {
+	struct epoch_record *r = R;
+	if (--r->nest == 0) {
+		__atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+	}
+}
+
+// call it with lock E
+static int
+try_advance(void) {
+	uint64_t e = E.epoch;
+	struct epoch_record *r;
+	for (r = __atomic_load_n(&E.record, __ATOMIC_ACQUIRE); r; r = r->next) {
+		uint64_t active = __atomic_load_n(&r->active, __ATOMIC_ACQUIRE);
+		if (active != 0 && active != e) {
+			return 0;
+		}
+	}
+	__atomic_store_n(&E.epoch, e + 1, __ATOMIC_RELEASE);
+	__sync_synchronize();
+	return 1;
+}
+
+void
+skynet_epoch_retire(void *ptr) {
+	// the ptr must be unlinked before any reader sees the new epoch
+	__sync_synchronize();
+	SPIN_LOCK(&E)
+	if (E.limbo_n >= E.limbo_cap) {
+		E.limbo_cap *= 2;
+		E.limbo = skynet_realloc(E.limbo, E.limbo_cap * sizeof(struct limbo));
+	}
+	E.limbo[E.limbo_n].ptr = ptr;
+	E.limbo[E.limbo_n].epoch = E.epoch;
+	++E.limbo_n;
+
+	// advance twice at most, so the ptr can be freed now when no reader is active
+	if (try_advance()) {
+		try_advance();
+	}
+
+	int i, j = 0;
+	for (i=0;i<E.limbo_n;i++) {
+		if (E.limbo[i].epoch + 2 <= E.epoch) {
+			skynet_free(E.limbo[i].ptr);
+		} else {
+			E.limbo[j++] = E.limbo[i];
+		}
+	}
+	E.limbo_n = j;
+	SPIN_UNLOCK(&E)
+}
+
+void
+skynet_epoch_init(void) {
+	E.epoch = 1;
+	E.record = NULL;
+	pthread_key_create(&E.key, record_release);
+	SPIN_INIT(&E)
+	E.limbo_n = 0;
+	E.limbo_cap = DEFAULT_LIMBO;
+	E.limbo = skynet_malloc(E.limbo_cap * sizeof(struct limbo));
+}
@@ -0,0 +1,15 @@
+#ifndef SKYNET_EPOCH_H
+#define SKYNET_EPOCH_H
+
+// Epoch based reclamation for lock-free readers (see skynet_handle_grab).
+// Readers access the shared pointers between skynet_epoch_enter and skynet_epoch_exit.
+// Writers unlink a pointer first, and then skynet_epoch_retire it. It will be freed
+// after all the readers which may see it have exited.
+
+void skynet_epoch_enter(void);
+void skynet_epoch_exit(void);
+void skynet_epoch_retire(void *ptr);	// skynet_free it later
+
+void skynet_epoch_init(void);
+
+#endif
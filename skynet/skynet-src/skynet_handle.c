@@ -2,6 +2,7 @@
 
 #include "skynet_handle.h"
 #include "skynet_server.h"
+#include "skynet_epoch.h"
 #include "rwlock.h"
 
 #include <stdlib.h>
@@ -10,31 +11,93 @@
 
 #define DEFAULT_SLOT_SIZE 4
 #define MAX_SLOT_SIZE 0x40000000
+#define DEFAULT_NAME_SIZE 16
 
 struct handle_name {
 	char * name;
+	uint32_t hash;
 	uint32_t handle;
 };
 
+// Open addressing (linear probe) hash of names, the load factor is less than 1/2.
+// A new name is inserted in place: hash and handle first, and then publish the name.
+// Removing names or growing rebuilds the whole table, the old one is freed by epoch,
+// so the readers (skynet_handle_findname) are lock-free.
+struct name_table {
+	int size;
+	int count;
+	struct handle_name entry[1];
+};
+
+// The slot array is replaced as a whole when it grows, so the readers (skynet_handle_grab)
+// can load it without lock. The old one is freed by skynet_epoch_retire.
+struct handle_slot {
+	int size;
+	struct skynet_context * ctx[1];
+};
+
+// the writers (register/retire/name) use lock, the readers of slot and name are lock-free
 struct handle_storage {
 	struct rwlock lock;
 
 	uint32_t harbor;
 	uint32_t handle_index;
-	int slot_size;
-	struct skynet_context ** slot;
+	struct handle_slot * slot;
 	
-	int name_cap;
-	int name_count;
-	struct handle_name *name;
+	uint32_t name_version;	// inc when any name is removed
+	struct name_table * name;
 };
 
 static struct handle_storage *H = NULL;
 
+static inline uint32_t
+name_hash(const char * name) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	const unsigned char * p = (const unsigned char *)name;
+	while (*p) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct name_table *
+name_new(int size) {
+	struct name_table * t = skynet_malloc(sizeof(*t) + (size - 1) * sizeof(struct handle_name));
+	t->size = size;
+	t->count = 0;
+	memset(t->entry, 0, size * sizeof(struct handle_name));
+	return t;
+}
+
+// call it with wlock, or before the table is published
+static void
+name_link(struct name_table * t, char * name, uint32_t hash, uint32_t handle) {
+	int mask = t->size - 1;
+	int i = hash & mask;
+	while (t->entry[i].name) {
+		i = (i + 1) & mask;
+	}
+	struct handle_name * n = &t->entry[i];
+	n->hash = hash;
+	n->handle = handle;
+	__atomic_store_n(&n->name, name, __ATOMIC_RELEASE);
+	++t->count;
+}
+
+static struct handle_slot *
+slot_new(int size) {
+	struct handle_slot * slot = skynet_malloc(sizeof(*slot) + (size - 1) * sizeof(struct skynet_context *));
+	slot->size = size;
+	memset(slot->ctx, 0, size * sizeof(struct skynet_context *));
+	return slot;
+}
+
 // handle_storage has multiple slots
 // each slot can used to store a skynet_context (ctx)
 // the skynet_context is stored according to auto genarated handle
-// if the handle is `handle`, then the stored slot index will be `handle&(s->slot_size-1)`
+// if the handle is `handle`, then the stored slot index will be `handle&(s->slot->size-1)`
 // auto genarated handle is stored in ctx->handle
 uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
@@ -43,20 +106,21 @@ skynet_handle_register(struct skynet_context *ctx) {
 	rwlock_wlock(&s->lock);
 	
 	for (;;) {
+		struct handle_slot * slot = s->slot;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;i<slot->size;i++) {
       // s->handle_index initialized with 1 
       // and it is updated when a new slot (a new skynet context) added
       // the first `handle` here will be 1, `hash` will be 1
 			uint32_t handle = (i+s->handle_index) & HANDLE_MASK;
-			int hash = handle & (s->slot_size-1);
+			int hash = handle & (slot->size-1);
 
       // 1. if found slot is empty when save this skynet context to it 
       // and return the handle (high 8-bit is sotred with the value of s->harbor
       // this handle will be stored to ctx->handle
       // 2. if current slot is not empty then continue loop to check next slot
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			if (slot->ctx[hash] == NULL) {
+				__atomic_store_n(&slot->ctx[hash], ctx, __ATOMIC_RELEASE);
         
         // s->handle_index will be: 1 => 2
 				s->handle_index = handle + 1;
@@ -69,20 +133,19 @@ skynet_handle_register(struct skynet_context *ctx) {
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
+		assert((slot->size*2 - 1) <= HANDLE_MASK);
 
     // if all slot is used then double the slot size 
     // and continue loop to find slot to save skynet_context
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		struct handle_slot * new_slot = slot_new(slot->size * 2);
+		for (i=0;i<slot->size;i++) {
+			int hash = skynet_context_handle(slot->ctx[i]) & (new_slot->size - 1);
+			assert(new_slot->ctx[hash] == NULL);
+			new_slot->ctx[hash] = slot->ctx[i];
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		// publish the new slot, the readers may still use the old one
+		__atomic_store_n(&s->slot, new_slot, __ATOMIC_RELEASE);
+		skynet_epoch_retire(slot);
 	}
 }
 
@@ -93,24 +156,40 @@ skynet_handle_retire(uint32_t handle) {
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot * slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = slot->ctx[hash];
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+		// the readers may grab ctx after it, skynet_context_trygrab fails when ref is 0
+		__atomic_store_n(&slot->ctx[hash], NULL, __ATOMIC_RELEASE);
 		ret = 1;
-		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
+		struct name_table * t = s->name;
+		int i, n = 0;
+		for (i=0; i<t->size; ++i) {
+			if (t->entry[i].name && t->entry[i].handle == handle) {
+				++n;
+			}
+		}
+		if (n > 0) {
+			// rebuild the table without the names of handle
+			struct name_table * nt = name_new(t->size);
+			for (i=0; i<t->size; ++i) {
+				struct handle_name * e = &t->entry[i];
+				if (e->name && e->handle != handle) {
+					name_link(nt, e->name, e->hash, e->handle);
+				}
+			}
+			__atomic_store_n(&s->name, nt, __ATOMIC_RELEASE);
+			for (i=0; i<t->size; ++i) {
+				if (t->entry[i].name && t->entry[i].handle == handle) {
+					skynet_epoch_retire(t->entry[i].name);
+				}
 			}
-			++j;
+			skynet_epoch_retire(t);
+			// the name caches (see _send in lua-skynet.c) are invalid now
+			__sync_add_and_fetch(&s->name_version, 1);
 		}
-		s->name_count = j;
 	} else {
 		ctx = NULL;
 	}
@@ -131,13 +210,19 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
-			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+		for (i=0;;i++) {
+			// the slot table may be swapped and retired at any time, read it (and its size) in the epoch
+			skynet_epoch_enter();
+			struct handle_slot * slot = __atomic_load_n(&s->slot, __ATOMIC_ACQUIRE);
+			if (i >= slot->size) {
+				skynet_epoch_exit();
+				break;
+			}
+			struct skynet_context * ctx = __atomic_load_n(&slot->ctx[i], __ATOMIC_ACQUIRE);
 			uint32_t handle = 0;
 			if (ctx)
 				handle = skynet_context_handle(ctx);
-			rwlock_runlock(&s->lock);
+			skynet_epoch_exit();
 			if (handle != 0) {
 				if (skynet_handle_retire(handle)) {
 					++n;
@@ -154,16 +239,16 @@ skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
 
-	rwlock_rlock(&s->lock);
+	skynet_epoch_enter();
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
-	if (ctx && skynet_context_handle(ctx) == handle) {
+	struct handle_slot * slot = __atomic_load_n(&s->slot, __ATOMIC_ACQUIRE);
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = __atomic_load_n(&slot->ctx[hash], __ATOMIC_ACQUIRE);
+	if (ctx && skynet_context_handle(ctx) == handle && skynet_context_trygrab(ctx)) {
 		result = ctx;
-		skynet_context_grab(result);
 	}
 
-	rwlock_runlock(&s->lock);
+	skynet_epoch_exit();
 
 	return result;
 }
@@ -171,79 +256,66 @@ skynet_handle_grab(uint32_t handle) {
 uint32_t 
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
-
-	rwlock_rlock(&s->lock);
-
+	uint32_t hash = name_hash(name);
 	uint32_t handle = 0;
 
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			handle = n->handle;
+	skynet_epoch_enter();
+
+	struct name_table * t = __atomic_load_n(&s->name, __ATOMIC_ACQUIRE);
+	int mask = t->size - 1;
+	int i = hash & mask;
+	for (;;) {
+		struct handle_name * n = &t->entry[i];
+		const char * str = __atomic_load_n(&n->name, __ATOMIC_ACQUIRE);
+		if (str == NULL) {
 			break;
 		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
+		if (n->hash == hash && strcmp(str, name) == 0) {
+			handle = n->handle;
+			break;
 		}
+		i = (i + 1) & mask;
 	}
 
-	rwlock_runlock(&s->lock);
+	skynet_epoch_exit();
 
 	return handle;
 }
 
-static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
-		}
-	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+uint32_t
+skynet_handle_nameversion(void) {
+	return __atomic_load_n(&H->name_version, __ATOMIC_ACQUIRE);
 }
 
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
+	uint32_t hash = name_hash(name);
+	struct name_table * t = s->name;
+	int mask = t->size - 1;
+	int i = hash & mask;
+	while (t->entry[i].name) {
+		struct handle_name *n = &t->entry[i];
+		if (n->hash == hash && strcmp(n->name, name) == 0) {
 			return NULL;
 		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
+		i = (i + 1) & mask;
+	}
+	if ((t->count + 1) * 2 > t->size) {
+		assert(t->size * 2 <= MAX_SLOT_SIZE);
+		struct name_table * nt = name_new(t->size * 2);
+		for (i=0;i<t->size;i++) {
+			struct handle_name *n = &t->entry[i];
+			if (n->name) {
+				name_link(nt, n->name, n->hash, n->handle);
+			}
 		}
+		__atomic_store_n(&s->name, nt, __ATOMIC_RELEASE);
+		skynet_epoch_retire(t);
+		t = nt;
 	}
 	char * result = skynet_strdup(name);
 
-	_insert_name_before(s, result, handle, begin);
+	name_link(t, result, hash, handle);
 
 	return result;
 }
@@ -265,9 +337,10 @@ skynet_handle_init(int harbor) {
 
   // alloc handle_storage and 4 slot, each slot is a pointer to skynet_context
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	s->slot = slot_new(DEFAULT_SLOT_SIZE);
+
+  // the slot array and the contexts are freed by epoch, see skynet_handle_grab
+	skynet_epoch_init();
 
   // init the handle storage read write lock
   // and init other members in the handle storage
@@ -275,9 +348,8 @@ skynet_handle_init(int harbor) {
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
-	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name_version = 0;
+	s->name = name_new(DEFAULT_NAME_SIZE);
 
   // store to the global handle storage H
 	H = s;
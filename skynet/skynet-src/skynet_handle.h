@@ -16,6 +16,8 @@ void skynet_handle_retireall();
 
 uint32_t skynet_handle_findname(const char * name);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
+// the version changes when any name is removed, for caching the result of findname
+uint32_t skynet_handle_nameversion(void);
 
 void skynet_handle_init(int harbor);
 
@@ -9,6 +9,17 @@ struct skynet_config {
 	const char * bootstrap;
 	const char * logger;
 	const char * logservice;
+	int worksteal;
+	int timeslice;
+	int msgstat;
+	int spin;
+	int tick;
+	int timerfd;
+	int readbudget;
+	int socket_thread;
+	int reuseport;
+	int maxsocket;
+	int acceptaddr;
 };
 
 #define THREAD_WORKER 0
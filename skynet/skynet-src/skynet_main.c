@@ -30,7 +30,6 @@ optint(const char *key, int opt) {
 	return strtol(str, NULL, 10);
 }
 
-/*
 static int
 optboolean(const char *key, int opt) {
 	const char * str = skynet_getenv(key);
@@ -40,7 +39,6 @@ optboolean(const char *key, int opt) {
 	}
 	return strcmp(str,"true")==0;
 }
-*/
 
 static const char *
 optstring(const char *key,const char * opt) {
@@ -254,6 +252,17 @@ main(int argc, char *argv[]) {
 	config.daemon = optstring("daemon", NULL);
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
+	config.worksteal = optboolean("worksteal", 0);
+	config.timeslice = optint("timeslice", 0);
+	config.msgstat = optboolean("msgstat", 0);
+	config.spin = optint("spin", 0);
+	config.tick = optint("tick", 10);
+	config.timerfd = optboolean("timerfd", 0);
+	config.readbudget = optint("readbudget", 0);
+	config.socket_thread = optint("socket_thread", 1);
+	config.reuseport = optboolean("reuseport", 0);
+	config.maxsocket = optint("maxsocket", 65536);
+	config.acceptaddr = optboolean("acceptaddr", 1);
 
   // close the Lua State that was used to run lua config code
 	lua_close(L);
@@ -15,4 +15,9 @@ void skynet_free(void *ptr);
 char * skynet_strdup(const char *str);
 void * skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);	// use for lua
 
+struct skynet_slab;
+struct skynet_slab * skynet_slab_new(void);
+void skynet_slab_delete(struct skynet_slab *s);
+void * skynet_slab_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);	// use for lua, ud is struct skynet_slab *
+
 #endif
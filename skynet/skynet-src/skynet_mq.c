@@ -2,6 +2,7 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +19,8 @@
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
+#ifndef USE_LOCKFREE_MQ
+
 struct message_queue {
 	struct spinlock lock;
 	uint32_t handle;
@@ -28,22 +31,90 @@ struct message_queue {
 	int in_global;
 	int overload;
 	int overload_threshold;
+	int flow_high;
+	int flow_low;
+	int flow_paused;
 	struct skynet_message *queue;
 	struct message_queue *next;
 };
 
-struct global_queue {
+#else
+
+// Lock-free multi-producer/single-consumer queue : a linked list of segments.
+// Producers claim a slot by increasing segment->alloc, and publish the message by setting slot->ready.
+// Only the worker which owns the queue (in_global is set) pops messages, so the consumer side needs no atomics.
+
+#define MQ_SEGMENT_SIZE 64
+
+struct mq_slot {
+	struct skynet_message msg;
+	int ready;
+};
+
+struct mq_segment {
+	struct mq_segment *next;
+	struct mq_segment *retired;	// link of retired list, don't reuse next because producers may still read it
+	unsigned base;	// the sequence of slot[0]
+	int alloc;	// claimed slots, may be larger than MQ_SEGMENT_SIZE when the segment is full
+	struct mq_slot slot[MQ_SEGMENT_SIZE];
+};
+
+struct message_queue {
+	uint32_t handle;
+	int release;
+	int in_global;
+	int overload;
+	int overload_threshold;
+	int flow_high;
+	int flow_low;
+	int flow_paused;
+	struct message_queue *next;
+	// consumer side
+	struct mq_segment *head;
+	int head_index;
+	unsigned popped;	// the sequence of head, for mq_size
+	struct mq_segment *retired;	// segments may still be touched by producers, free them when producers is 0
+	// producer side, in another cache line
+	char padding[64];
+	struct mq_segment *tail;
+	int producers;
+};
+
+#endif
+
+// a FIFO list of message queues which have messages to dispatch
+struct queue_list {
 	struct message_queue *head;
 	struct message_queue *tail;
+	int n;
 	struct spinlock lock;
 };
 
+// each worker thread owns a local run queue when work stealing is enabled.
+// pad it to a cache line, so the workers don't share the lock's line
+struct local_queue {
+	struct queue_list list;
+	unsigned tick;
+	char padding[64 - sizeof(struct queue_list) % 64];
+};
+
+struct global_queue {
+	struct queue_list global;
+	int nlocal;
+	struct local_queue *local;
+};
+
+// check the global queue every MQ_GLOBAL_CHECK pops even if the local queue isn't empty,
+// otherwise the queues pushed by socket/timer thread may starve.
+#define MQ_GLOBAL_CHECK 61
+
 static struct global_queue *Q = NULL;
 
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+// the local run queue index of current thread, -1 means not a worker (or work stealing is off)
+static __thread int LOCAL_ID = -1;
 
+static void
+list_push(struct queue_list *q, struct message_queue *queue) {
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
 	if(q->tail) {
@@ -52,14 +123,12 @@ skynet_globalmq_push(struct message_queue * queue) {
 	} else {
 		q->head = q->tail = queue;
 	}
+	++q->n;
 	SPIN_UNLOCK(q)
 }
 
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
-
-	SPIN_LOCK(q)
+static inline struct message_queue *
+list_pop_nolock(struct queue_list *q) {
 	struct message_queue *mq = q->head;
 	if(mq) {
 		q->head = mq->next;
@@ -68,12 +137,150 @@ skynet_globalmq_pop() {
 			q->tail = NULL;
 		}
 		mq->next = NULL;
+		--q->n;
 	}
+	return mq;
+}
+
+static struct message_queue *
+list_pop(struct queue_list *q) {
+	// read head without lock first, an empty list is the common case for idle workers
+	if (q->head == NULL)
+		return NULL;
+	SPIN_LOCK(q)
+	struct message_queue *mq = list_pop_nolock(q);
 	SPIN_UNLOCK(q)
 
 	return mq;
 }
 
+// steal half of the queues from the victim, keep the first one and move others to lq.
+static struct message_queue *
+steal(struct local_queue *victim, struct local_queue *lq) {
+	struct queue_list *v = &victim->list;
+	if (v->head == NULL)
+		return NULL;
+	// never wait for a busy victim, try the next one instead
+	if (!spinlock_trylock(&v->lock))
+		return NULL;
+	struct message_queue *mq = list_pop_nolock(v);
+	if (mq == NULL) {
+		SPIN_UNLOCK(v)
+		return NULL;
+	}
+	int n = v->n / 2;
+	struct message_queue *head = NULL;
+	struct message_queue *tail = NULL;
+	if (n > 0) {
+		head = tail = v->head;
+		int i;
+		for (i=1;i<n;i++) {
+			tail = tail->next;
+		}
+		v->head = tail->next;
+		if (v->head == NULL) {
+			v->tail = NULL;
+		}
+		tail->next = NULL;
+		v->n -= n;
+	}
+	SPIN_UNLOCK(v)
+
+	if (head) {
+		struct queue_list *q = &lq->list;
+		SPIN_LOCK(q)
+		if (q->tail) {
+			q->tail->next = head;
+		} else {
+			q->head = head;
+		}
+		q->tail = tail;
+		q->n += n;
+		SPIN_UNLOCK(q)
+	}
+	return mq;
+}
+
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	struct global_queue *q= Q;
+	int id = LOCAL_ID;
+	if (id >= 0) {
+		list_push(&q->local[id].list, queue);
+	} else {
+		list_push(&q->global, queue);
+	}
+}
+
+struct message_queue * 
+skynet_globalmq_pop() {
+	struct global_queue *q = Q;
+	int id = LOCAL_ID;
+	if (id < 0) {
+		return list_pop(&q->global);
+	}
+
+	struct local_queue *lq = &q->local[id];
+	struct message_queue *mq;
+	if (++lq->tick % MQ_GLOBAL_CHECK == 0) {
+		mq = list_pop(&q->global);
+		if (mq)
+			return mq;
+	}
+	mq = list_pop(&lq->list);
+	if (mq)
+		return mq;
+	mq = list_pop(&q->global);
+	if (mq)
+		return mq;
+
+	// local and global queues are empty, steal from other workers
+	int i;
+	for (i=1;i<q->nlocal;i++) {
+		mq = steal(&q->local[(id + i) % q->nlocal], lq);
+		if (mq)
+			return mq;
+	}
+	return NULL;
+}
+
+int
+skynet_globalmq_length(void) {
+	struct global_queue *q = Q;
+	int n = q->global.n;
+	int i;
+	for (i=0;i<q->nlocal;i++) {
+		n += q->local[i].list.n;
+	}
+	return n;
+}
+
+void
+skynet_globalmq_bind(int id) {
+	if (id < Q->nlocal) {
+		LOCAL_ID = id;
+	}
+}
+
+void 
+skynet_mq_init(int nlocal) {
+	struct global_queue *q = skynet_malloc(sizeof(*q));
+	memset(q,0,sizeof(*q));
+	SPIN_INIT(&q->global);
+	if (nlocal > 0) {
+		q->nlocal = nlocal;
+		q->local = skynet_malloc(nlocal * sizeof(struct local_queue));
+		memset(q->local, 0, nlocal * sizeof(struct local_queue));
+		int i;
+		for (i=0;i<nlocal;i++) {
+			SPIN_INIT(&q->local[i].list);
+		}
+	}
+	Q=q;
+}
+
+#ifndef USE_LOCKFREE_MQ
+
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));
@@ -89,6 +296,9 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
+	q->flow_high = 0;
+	q->flow_low = 0;
+	q->flow_paused = 0;
 	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
 	q->next = NULL;
 
@@ -103,11 +313,6 @@ _release(struct message_queue *q) {
 	skynet_free(q);
 }
 
-uint32_t 
-skynet_mq_handle(struct message_queue *q) {
-	return q->handle;
-}
-
 int
 skynet_mq_length(struct message_queue *q) {
 	int head, tail,cap;
@@ -124,31 +329,28 @@ skynet_mq_length(struct message_queue *q) {
 	return tail + cap - head;
 }
 
-int
-skynet_mq_overload(struct message_queue *q) {
-	if (q->overload) {
-		int overload = q->overload;
-		q->overload = 0;
-		return overload;
-	} 
-	return 0;
+// any thread can call it
+static inline int
+mq_size(struct message_queue *q) {
+	return skynet_mq_length(q);
 }
 
 int
-skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int n) {
+	int ret = 0;
 	SPIN_LOCK(q)
 
 	if (q->head != q->tail) {
-		*message = q->queue[q->head++];
-		ret = 0;
 		int head = q->head;
 		int tail = q->tail;
 		int cap = q->cap;
-
-		if (head >= cap) {
-			q->head = head = 0;
+		while (ret < n && head != tail) {
+			message[ret++] = q->queue[head++];
+			if (head >= cap) {
+				head = 0;
+			}
 		}
+		q->head = head;
 		int length = tail - head;
 		if (length < 0) {
 			length += cap;
@@ -162,7 +364,7 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 		q->overload_threshold = MQ_OVERLOAD;
 	}
 
-	if (ret) {
+	if (ret == 0) {
 		q->in_global = 0;
 	}
 	
@@ -208,14 +410,6 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	SPIN_UNLOCK(q)
 }
 
-void 
-skynet_mq_init() {
-	struct global_queue *q = skynet_malloc(sizeof(*q));
-	memset(q,0,sizeof(*q));
-	SPIN_INIT(q);
-	Q=q;
-}
-
 void 
 skynet_mq_mark_release(struct message_queue *q) {
 	SPIN_LOCK(q)
@@ -227,14 +421,7 @@ skynet_mq_mark_release(struct message_queue *q) {
 	SPIN_UNLOCK(q)
 }
 
-static void
-_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
-	struct skynet_message msg;
-	while(!skynet_mq_pop(q, &msg)) {
-		drop_func(&msg, ud);
-	}
-	_release(q);
-}
+static void _drop_queue(struct message_queue *q, message_drop drop_func, void *ud);
 
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
@@ -248,3 +435,291 @@ skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 		SPIN_UNLOCK(q)
 	}
 }
+
+#else
+
+static struct mq_segment *
+new_segment(unsigned base) {
+	struct mq_segment *seg = skynet_malloc(sizeof(*seg));
+	memset(seg, 0, sizeof(*seg));
+	seg->base = base;
+	return seg;
+}
+
+static void
+free_segments(struct mq_segment *seg) {
+	while (seg) {
+		struct mq_segment *next = seg->next;
+		skynet_free(seg);
+		seg = next;
+	}
+}
+
+static void
+free_retired(struct mq_segment *seg) {
+	while (seg) {
+		struct mq_segment *next = seg->retired;
+		skynet_free(seg);
+		seg = next;
+	}
+}
+
+struct message_queue * 
+skynet_mq_create(uint32_t handle) {
+	struct message_queue *q = skynet_malloc(sizeof(*q));
+	memset(q, 0, sizeof(*q));
+	q->handle = handle;
+	// See the comment of skynet_mq_create above
+	q->in_global = MQ_IN_GLOBAL;
+	q->overload_threshold = MQ_OVERLOAD;
+	q->head = q->tail = new_segment(0);
+
+	return q;
+}
+
+static void 
+_release(struct message_queue *q) {
+	assert(q->next == NULL);
+	free_retired(q->retired);
+	free_segments(q->head);
+	skynet_free(q);
+}
+
+// only the consumer calls it (dispatch and cmd_mqlen), so q->tail can't be retired during the call.
+int
+skynet_mq_length(struct message_queue *q) {
+	struct mq_segment *tail = q->tail;
+	int alloc = tail->alloc;
+	if (alloc > MQ_SEGMENT_SIZE) {
+		alloc = MQ_SEGMENT_SIZE;
+	}
+	int length = (int)(tail->base + alloc - (q->head->base + q->head_index));
+	return length < 0 ? 0 : length;
+}
+
+// Any thread can call it. As a producer, it keeps q->tail from being freed (see skynet_mq_pop_batch).
+static int
+mq_size(struct message_queue *q) {
+	ATOM_INC(&q->producers);
+	struct mq_segment *tail = q->tail;
+	int alloc = tail->alloc;
+	if (alloc > MQ_SEGMENT_SIZE) {
+		alloc = MQ_SEGMENT_SIZE;
+	}
+	unsigned pushed = tail->base + alloc;
+	ATOM_DEC(&q->producers);
+	int length = (int)(pushed - q->popped);
+	return length < 0 ? 0 : length;
+}
+
+// return the next ready slot (for consumer), move to the next segment if the head segment is exhausted.
+static struct mq_slot *
+peek_slot(struct message_queue *q) {
+	struct mq_segment *seg = q->head;
+	if (q->head_index == MQ_SEGMENT_SIZE) {
+		struct mq_segment *next = seg->next;
+		if (next == NULL)
+			return NULL;
+		// make sure no new producer can see the old segment, and then retire it
+		ATOM_CAS_POINTER(&q->tail, seg, next);
+		seg->retired = q->retired;
+		q->retired = seg;
+		q->head = seg = next;
+		q->head_index = 0;
+	}
+	struct mq_slot *slot = &seg->slot[q->head_index];
+	if (!slot->ready) {
+		// empty, or the producer hasn't finished writing
+		return NULL;
+	}
+	__sync_synchronize();
+	return slot;
+}
+
+static inline void
+collect_retired(struct message_queue *q) {
+	if (q->retired && q->producers == 0) {
+		// All the producers which may load a retired segment have left.
+		free_retired(q->retired);
+		q->retired = NULL;
+	}
+}
+
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int n) {
+	int ret = 0;
+	for (;;) {
+		while (ret < n) {
+			struct mq_slot *slot = peek_slot(q);
+			if (slot == NULL)
+				break;
+			message[ret++] = slot->msg;
+			++q->head_index;
+		}
+		if (ret > 0) {
+			q->popped = q->head->base + q->head_index;
+			int length = skynet_mq_length(q);
+			while (length > q->overload_threshold) {
+				q->overload = length;
+				q->overload_threshold *= 2;
+			}
+			collect_retired(q);
+			return ret;
+		}
+		// The consumer state must be settled before in_global is cleared,
+		// because another worker may own the queue right after it.
+		collect_retired(q);
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		struct mq_segment *seg = q->head;
+		int index = q->head_index;
+		// as a producer, keep seg from being freed by the next owner while we check it
+		ATOM_INC(&q->producers);
+		q->in_global = 0;
+		__sync_synchronize();
+		// A producer may publish a message after we see the queue empty.
+		// Both sides set their flag first and then check the other's, so at least one of us will see it,
+		// and the CAS decides who puts the queue back to global queue.
+		// Don't cross the segment here, a linked next segment is treated as not empty.
+		int empty = (index == MQ_SEGMENT_SIZE) ? (seg->next == NULL) : !seg->slot[index].ready;
+		ATOM_DEC(&q->producers);
+		if (empty || !ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+			// q may be owned by another worker now, don't touch it
+			return 0;
+		}
+	}
+}
+
+void 
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	assert(message);
+	ATOM_INC(&q->producers);
+	for (;;) {
+		struct mq_segment *seg = q->tail;
+		int index = ATOM_FINC(&seg->alloc);
+		if (index < MQ_SEGMENT_SIZE) {
+			struct mq_slot *slot = &seg->slot[index];
+			slot->msg = *message;
+			__sync_synchronize();
+			slot->ready = 1;
+			break;
+		}
+		// the segment is full, link a new one and help to move the tail
+		struct mq_segment *next = seg->next;
+		if (next == NULL) {
+			next = new_segment(seg->base + MQ_SEGMENT_SIZE);
+			if (!ATOM_CAS_POINTER(&seg->next, NULL, next)) {
+				skynet_free(next);
+				next = seg->next;
+			}
+		}
+		ATOM_CAS_POINTER(&q->tail, seg, next);
+	}
+	ATOM_DEC(&q->producers);
+
+	if (q->in_global == 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+void 
+skynet_mq_mark_release(struct message_queue *q) {
+	assert(q->release == 0);
+	q->release = 1;
+	__sync_synchronize();
+	if (q->in_global == 0 && ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+static void _drop_queue(struct message_queue *q, message_drop drop_func, void *ud);
+
+void 
+skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	__sync_synchronize();
+	if (q->release) {
+		_drop_queue(q, drop_func, ud);
+	} else {
+		skynet_globalmq_push(q);
+	}
+}
+
+#endif
+
+uint32_t 
+skynet_mq_handle(struct message_queue *q) {
+	return q->handle;
+}
+
+int
+skynet_mq_overload(struct message_queue *q) {
+	if (q->overload) {
+		int overload = q->overload;
+		q->overload = 0;
+		return overload;
+	} 
+	return 0;
+}
+
+int
+skynet_mq_flowcontrol(struct message_queue *q, int high, int low) {
+	if (high <= 0) {
+		high = 0;
+		low = 0;
+	} else if (low < 0 || low > high) {
+		low = high / 2;
+	}
+	q->flow_low = low;
+	q->flow_high = high;
+	__sync_synchronize();
+	// resume the paused sockets when flow control is turned off
+	return high == 0 && q->flow_paused && ATOM_CAS(&q->flow_paused, 1, 0);
+}
+
+int
+skynet_mq_flowpause(struct message_queue *q) {
+	int high = q->flow_high;
+	if (high <= 0 || mq_size(q) <= high) {
+		return 0;
+	}
+	if (q->flow_paused == 0) {
+		ATOM_CAS(&q->flow_paused, 0, 1);
+	}
+	__sync_synchronize();
+	// The consumer may drain the queue before it sees the flag, so check it again.
+	// If the consumer clears the flag first, it will resume after the pause.
+	if (mq_size(q) <= q->flow_low && ATOM_CAS(&q->flow_paused, 1, 0)) {
+		return 0;
+	}
+	return 1;
+}
+
+int
+skynet_mq_flowresume(struct message_queue *q) {
+	// pairs with the fence in skynet_mq_flowpause : the pops before must be visible before we read the flag
+	__sync_synchronize();
+	if (q->flow_paused == 0) {
+		return 0;
+	}
+	if (mq_size(q) > q->flow_low) {
+		return 0;
+	}
+	return ATOM_CAS(&q->flow_paused, 1, 0);
+}
+
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	return skynet_mq_pop_batch(q, message, 1) == 0;
+}
+
+static void
+_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
+	struct skynet_message msg[MQ_BATCH];
+	int i,n;
+	while ((n = skynet_mq_pop_batch(q, msg, MQ_BATCH))) {
+		for (i=0;i<n;i++) {
+			drop_func(&msg[i], ud);
+		}
+	}
+	_release(q);
+}
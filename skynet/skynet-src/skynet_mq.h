@@ -9,6 +9,7 @@ struct skynet_message {
 	int session;
 	void * data;
 	size_t sz;
+	uint64_t stamp;	// enqueue time in nanoseconds, only set when msgstat is enabled
 };
 
 // type is encoding in skynet_message.sz high 8bit
@@ -19,6 +20,10 @@ struct message_queue;
 
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+// the number of message queues waiting for dispatch (approximate)
+int skynet_globalmq_length(void);
+// bind current worker thread to its local run queue (only if work stealing is enabled)
+void skynet_globalmq_bind(int id);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
@@ -28,14 +33,29 @@ typedef void (*message_drop)(struct skynet_message *, void *);
 void skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud);
 uint32_t skynet_mq_handle(struct message_queue *);
 
+// the max number of messages popped by one skynet_mq_pop_batch in dispatch
+#define MQ_BATCH 16
+
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
+// pop at most n messages, return the number of messages. 0 means the queue is empty (and it leaves global queue)
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int n);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+// Flow control of socket data : the socket thread pauses reading the sockets of the service when the queue is longer than high,
+// and the service resumes them when it's not longer than low. high = 0 turns it off.
+// return 1 if the paused sockets should be resumed (flow control is turned off)
+int skynet_mq_flowcontrol(struct message_queue *q, int high, int low);
+// for the socket thread (producer), return 1 if the socket should be paused
+int skynet_mq_flowpause(struct message_queue *q);
+// for the consumer, return 1 if the paused sockets should be resumed
+int skynet_mq_flowresume(struct message_queue *q);
+
+// nlocal is the number of per-worker local run queues, 0 means only one global queue
+void skynet_mq_init(int nlocal);
 
 #endif
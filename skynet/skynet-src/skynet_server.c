@@ -10,6 +10,9 @@
 #include "skynet_monitor.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
+#include "skynet_stat.h"
+#include "skynet_epoch.h"
+#include "skynet_socket.h"
 #include "spinlock.h"
 #include "atomic.h"
 
@@ -20,6 +23,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <math.h>
 
 #ifdef CALLING_CHECK
 
@@ -52,6 +56,8 @@ struct skynet_context {
 	int ref;
 	bool init;
 	bool endless;
+	uint64_t cost;	// average nanoseconds per message, for adaptive dispatch
+	struct skynet_stat * stat;	// NULL if msgstat is disabled
 
 	CHECKCALLING_DECL
 };
@@ -61,6 +67,9 @@ struct skynet_node {
 	int init;
 	uint32_t monitor_exit;
 	pthread_key_t handle_key;
+	uint64_t timeslice;	// nanoseconds, 0 means static weight
+	int thread;
+	int msgstat;
 };
 
 static struct skynet_node G_NODE;
@@ -77,7 +86,10 @@ context_inc() {
 
 static void
 context_dec() {
-	ATOM_DEC(&G_NODE.total);
+	if (ATOM_DEC(&G_NODE.total) == 0) {
+		// the timer thread may block on timerfd, wake it to exit
+		skynet_timer_interrupt();
+	}
 }
 
 uint32_t 
@@ -154,6 +166,8 @@ skynet_context_new(const char * name, const char *param) {
 
 	ctx->init = false;
 	ctx->endless = false;
+	ctx->cost = 0;
+	ctx->stat = G_NODE.msgstat ? skynet_stat_new() : NULL;
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	ctx->handle = 0;	
 
@@ -217,6 +231,20 @@ skynet_context_grab(struct skynet_context *ctx) {
 	ATOM_INC(&ctx->ref);
 }
 
+// grab the context only if it's not deleting (ref > 0), for the lock-free skynet_handle_grab
+int
+skynet_context_trygrab(struct skynet_context *ctx) {
+	int ref = ctx->ref;
+	while (ref > 0) {
+		int old = __sync_val_compare_and_swap(&ctx->ref, ref, ref + 1);
+		if (old == ref) {
+			return 1;
+		}
+		ref = old;
+	}
+	return 0;
+}
+
 void
 skynet_context_reserve(struct skynet_context *ctx) {
 	skynet_context_grab(ctx);
@@ -232,8 +260,12 @@ delete_context(struct skynet_context *ctx) {
 	}
 	skynet_module_instance_release(ctx->mod, ctx->instance);
 	skynet_mq_mark_release(ctx->queue);
+	if (ctx->stat) {
+		skynet_stat_delete(ctx->stat);
+	}
 	CHECKCALLING_DESTROY(ctx)
-	skynet_free(ctx);
+	// skynet_handle_grab may read ctx without lock, free it later
+	skynet_epoch_retire(ctx);
 	context_dec();
 }
 
@@ -246,18 +278,47 @@ skynet_context_release(struct skynet_context *ctx) {
 	return ctx;
 }
 
+void
+skynet_context_msgstat(int enable) {
+	G_NODE.msgstat = enable;
+}
+
 int
 skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
 	if (ctx == NULL) {
 		return -1;
 	}
+	if (G_NODE.msgstat) {
+		message->stamp = skynet_gettime_ns();
+	}
 	skynet_mq_push(ctx->queue, message);
 	skynet_context_release(ctx);
 
 	return 0;
 }
 
+int
+skynet_context_pushflow(uint32_t handle, struct skynet_message *message) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	if (G_NODE.msgstat) {
+		message->stamp = skynet_gettime_ns();
+	}
+	skynet_mq_push(ctx->queue, message);
+	int pause = skynet_mq_flowpause(ctx->queue);
+	skynet_context_release(ctx);
+
+	return pause;
+}
+
+int
+skynet_context_flowcontrol(struct skynet_context *ctx, int high, int low) {
+	return skynet_mq_flowcontrol(ctx->queue, high, low);
+}
+
 void 
 skynet_context_endless(uint32_t handle) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);
@@ -287,9 +348,17 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	if (ctx->logfile) {
 		skynet_log_output(ctx->logfile, msg->source, type, msg->session, msg->data, sz);
 	}
+	uint64_t start = 0;
+	if (ctx->stat) {
+		start = skynet_gettime_ns();
+	}
 	if (!ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz)) {
 		skynet_free(msg->data);
 	} 
+	if (ctx->stat) {
+		uint64_t wait = start > msg->stamp ? start - msg->stamp : 0;
+		skynet_stat_message(ctx->stat, type, wait, skynet_gettime_ns() - start);
+	}
 	CHECKCALLING_END(ctx)
 }
 
@@ -303,6 +372,44 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+void
+skynet_context_timeslice(int microsec, int thread) {
+	G_NODE.timeslice = microsec > 0 ? (uint64_t)microsec * 1000 : 0;
+	G_NODE.thread = thread;
+}
+
+// The time slice of this turn. When more queues are waiting than workers,
+// shorten the turn, so the small services don't wait behind a heavy one for long.
+static uint64_t
+dispatch_slice(void) {
+	uint64_t slice = G_NODE.timeslice;
+	int waiting = skynet_globalmq_length();
+	if (waiting > G_NODE.thread) {
+		slice = slice * G_NODE.thread / waiting;
+		if (slice < G_NODE.timeslice / 8) {
+			slice = G_NODE.timeslice / 8;
+		}
+	}
+	return slice;
+}
+
+// how many messages can be popped in the time left, according to the average cost
+static int
+slice_batch(struct skynet_context *ctx, uint64_t left, int batch) {
+	if (ctx->cost == 0) {
+		// unknown cost, try one message first
+		return 1;
+	}
+	uint64_t n = left / ctx->cost;
+	if (n < 1) {
+		return 1;
+	}
+	if (n < batch) {
+		return (int)n;
+	}
+	return batch;
+}
+
 struct message_queue * 
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
 	if (q == NULL) {
@@ -321,30 +428,78 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	}
 
 	int i,n=1;
-	struct skynet_message msg;
-
-	for (i=0;i<n;i++) {
-		if (skynet_mq_pop(q,&msg)) {
+	uint64_t slice = 0;
+	uint64_t start = 0, last = 0;
+	if (G_NODE.timeslice) {
+		// adaptive : dispatch until the queue is empty or the time slice is used up
+		slice = dispatch_slice();
+		n = skynet_mq_length(q);
+		if (n < 1) {
+			n = 1;
+		}
+		start = last = skynet_gettime_ns();
+	} else if (weight >= 0) {
+		n = skynet_mq_length(q) >> weight;
+		if (n < 1) {
+			n = 1;
+		}
+	}
+	struct skynet_message msg[MQ_BATCH];
+
+	// pop the messages in batch, so the queue is touched once for MQ_BATCH messages
+	for (i=0;i<n;) {
+		int j;
+		int batch = n - i < MQ_BATCH ? n - i : MQ_BATCH;
+		if (slice) {
+			batch = slice_batch(ctx, slice - (last - start), batch);
+		}
+		batch = skynet_mq_pop_batch(q, msg, batch);
+		if (batch == 0) {
+			// the queue may be drained by the last batch, after the producer paused the sockets
+			if (skynet_mq_flowresume(q)) {
+				skynet_socket_resume(handle);
+			}
 			skynet_context_release(ctx);
 			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
 		}
 		int overload = skynet_mq_overload(q);
 		if (overload) {
 			skynet_error(ctx, "May overload, message queue length = %d", overload);
 		}
+		if (skynet_mq_flowresume(q)) {
+			skynet_socket_resume(handle);
+		}
 
-		skynet_monitor_trigger(sm, msg.source , handle);
+		for (j=0;j<batch;j++) {
+			skynet_monitor_trigger(sm, msg[j].source , handle);
 
-		if (ctx->cb == NULL) {
-			skynet_free(msg.data);
-		} else {
-			dispatch_message(ctx, &msg);
-		}
+			if (ctx->cb == NULL) {
+				skynet_free(msg[j].data);
+			} else {
+				dispatch_message(ctx, &msg[j]);
+			}
 
-		skynet_monitor_trigger(sm, 0,0);
+			skynet_monitor_trigger(sm, 0,0);
+
+			if (slice) {
+				uint64_t now = skynet_gettime_ns();
+				uint64_t cost = now - last;
+				last = now;
+				if (cost == 0) {
+					cost = 1;
+				}
+				// moving average, 1/8 weight for the new sample
+				if (ctx->cost == 0) {
+					ctx->cost = cost;
+				} else {
+					ctx->cost = ctx->cost - (ctx->cost >> 3) + (cost >> 3);
+				}
+			}
+		}
+		i += batch;
+		if (slice && last - start >= slice) {
+			break;
+		}
 	}
 
 	assert(q == ctx->queue);
@@ -404,16 +559,32 @@ struct command_func {
 	const char * (*func)(struct skynet_context * context, const char * param);
 };
 
+// param is centisecond, it can be a fraction (ie. 0.5 for 5ms) when the tick is less than 10ms
 static const char *
 cmd_timeout(struct skynet_context * context, const char * param) {
 	char * session_ptr = NULL;
 	int ti = strtol(param, &session_ptr, 10);
 	int session = skynet_context_newsession(context);
-	skynet_timeout(context->handle, ti, session);
+	if (*session_ptr == '.') {
+		double ms = strtod(param, NULL) * 10;
+		skynet_timeout_ms(context->handle, (int)ceil(ms), session);
+	} else {
+		skynet_timeout(context->handle, ti, session);
+	}
 	sprintf(context->result, "%d", session);
 	return context->result;
 }
 
+static const char *
+cmd_untimeout(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	if (skynet_timeout_cancel(context->handle, session)) {
+		strcpy(context->result, "1");
+		return context->result;
+	}
+	return NULL;
+}
+
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {
@@ -590,6 +761,42 @@ cmd_mqlen(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+// STAT count [type] : the number of messages (of the type) dispatched
+// STAT wait|exec percent|max : the percentile of queue wait time or callback time in nanoseconds
+// STAT reset
+static const char *
+cmd_stat(struct skynet_context * context, const char * param) {
+	struct skynet_stat *stat = context->stat;
+	if (stat == NULL || param == NULL)
+		return NULL;
+	size_t sz = strlen(param);
+	char what[sz+1];
+	char arg[sz+1];
+	arg[0] = '\0';
+	if (sscanf(param, "%s %s", what, arg) < 1) {
+		// empty or blank param
+		return NULL;
+	}
+	uint64_t v;
+	if (strcmp(what, "count") == 0) {
+		v = skynet_stat_count(stat, arg[0] ? strtol(arg, NULL, 10) : -1);
+	} else if (strcmp(what, "wait") == 0 || strcmp(what, "exec") == 0) {
+		int h = what[0] == 'w' ? STAT_WAIT : STAT_EXEC;
+		if (strcmp(arg, "max") == 0) {
+			v = skynet_stat_max(stat, h);
+		} else {
+			v = skynet_stat_percentile(stat, h, strtod(arg, NULL));
+		}
+	} else if (strcmp(what, "reset") == 0) {
+		skynet_stat_reset(stat);
+		return NULL;
+	} else {
+		return NULL;
+	}
+	sprintf(context->result, "%llu", (unsigned long long)v);
+	return context->result;
+}
+
 static const char *
 cmd_logon(struct skynet_context * context, const char * param) {
 	uint32_t handle = tohandle(context, param);
@@ -654,6 +861,7 @@ cmd_signal(struct skynet_context * context, const char * param) {
 
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },
+	{ "UNTIMEOUT", cmd_untimeout },
 	{ "REG", cmd_reg },
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },
@@ -668,6 +876,7 @@ static struct command_func cmd_funcs[] = {
 	{ "ABORT", cmd_abort },
 	{ "MONITOR", cmd_monitor },
 	{ "MQLEN", cmd_mqlen },
+	{ "STAT", cmd_stat },
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ "SIGNAL", cmd_signal },
@@ -817,6 +1026,7 @@ skynet_context_send(struct skynet_context * ctx, void * msg, size_t sz, uint32_t
 	smsg.session = session;
 	smsg.data = msg;
 	smsg.sz = sz | (size_t)type << MESSAGE_TYPE_SHIFT;
+	smsg.stamp = G_NODE.msgstat ? skynet_gettime_ns() : 0;
 
 	skynet_mq_push(ctx->queue, &smsg);
 }
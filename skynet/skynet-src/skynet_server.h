@@ -10,14 +10,21 @@ struct skynet_monitor;
 
 struct skynet_context * skynet_context_new(const char * name, const char * parm);
 void skynet_context_grab(struct skynet_context *);
+int skynet_context_trygrab(struct skynet_context *);	// return 0 if the context is deleting
 void skynet_context_reserve(struct skynet_context *ctx);
 struct skynet_context * skynet_context_release(struct skynet_context *);
 uint32_t skynet_context_handle(struct skynet_context *);
 int skynet_context_push(uint32_t handle, struct skynet_message *message);
+// push socket data, return 1 if the queue is longer than the high watermark of flow control (the socket should be paused)
+int skynet_context_pushflow(uint32_t handle, struct skynet_message *message);
+// set the watermarks of flow control, return 1 if the paused sockets should be resumed
+int skynet_context_flowcontrol(struct skynet_context *ctx, int high, int low);
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 int skynet_context_newsession(struct skynet_context *);
 struct message_queue * skynet_context_message_dispatch(struct skynet_monitor *, struct message_queue *, int weight);	// return next queue
 int skynet_context_total();
+void skynet_context_timeslice(int microsec, int thread);	// use adaptive dispatch if microsec > 0
+void skynet_context_msgstat(int enable);	// collect the histograms of message wait/exec time
 void skynet_context_dispatchall(struct skynet_context * context);	// for skynet_error output before exit
 
 void skynet_context_endless(uint32_t handle);	// for monitor
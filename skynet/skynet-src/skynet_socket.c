@@ -5,32 +5,161 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "spinlock.h"
+#include "atomic.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-static struct socket_server * SOCKET_SERVER = NULL;
+/*
+	Sockets are sharded to SHARD_N socket servers, each one is polled by its own socket thread.
+	The low SHARD_BITS bits of a socket id is the shard, and the rest is the id in that socket server.
+	New connect/bind/udp sockets are spread to the shards in turn. Without reuseport, the listening sockets
+	are all in shard 0, so are the connections accepted from them.
+	With reuseport, a listening socket is opened in every shard, the kernel spreads the connections among them,
+	and the accept messages report the id of the first one (the id returned by skynet_socket_listen).
+ */
+
+#define MAX_SHARD_BITS 4
+#define MAX_SHARD (1 << MAX_SHARD_BITS)
+
+#define SHARD(id) ((id) & ((1 << SHARD_BITS) - 1))
+#define LOCAL_ID(id) ((id) >> SHARD_BITS)
+#define GLOBAL_ID(id, shard) ((id) < 0 ? (id) : ((id) << SHARD_BITS | (shard)))
+
+struct listen_group {
+	struct listen_group * next;
+	int id[MAX_SHARD];
+};
+
+static struct socket_server * SOCKET_SERVER[MAX_SHARD];
+static int SHARD_N = 0;
+static int SHARD_BITS = 0;
+static int SHARD_NEXT = 0;
+static int REUSEPORT = 0;
+
+static struct spinlock LISTEN_LOCK;
+static struct listen_group * LISTEN_GROUP = NULL;
+
+// return the socket server of id, and convert id to the local id of it
+static inline struct socket_server *
+shard_server(int *id) {
+	int shard = 0;
+	if (*id >= 0) {
+		shard = SHARD(*id);
+		if (shard >= SHARD_N) {
+			// invalid id
+			shard = 0;
+			*id = -1;
+		} else {
+			*id = LOCAL_ID(*id);
+		}
+	}
+	return SOCKET_SERVER[shard];
+}
+
+// new sockets (connect/bind/udp) are spread to the shards in turn
+static inline int
+shard_next() {
+	if (SHARD_N == 1)
+		return 0;
+	return (unsigned)ATOM_FINC(&SHARD_NEXT) % SHARD_N;
+}
 
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create();
+skynet_socket_init(int shard, int readbudget, int reuseport, int maxsocket, int acceptaddr) {
+	if (shard < 1) {
+		shard = 1;
+	} else if (shard > MAX_SHARD) {
+		shard = MAX_SHARD;
+	}
+	SHARD_N = shard;
+	SHARD_BITS = 0;
+	while ((1 << SHARD_BITS) < shard) {
+		++SHARD_BITS;
+	}
+	REUSEPORT = reuseport && shard > 1;
+	spinlock_init(&LISTEN_LOCK);
+	int i;
+	for (i=0;i<SHARD_N;i++) {
+		struct socket_server * ss = socket_server_create();
+		assert(ss);
+		socket_server_readbudget(ss, readbudget);
+		socket_server_maxsocket(ss, maxsocket);
+		socket_server_acceptaddr(ss, acceptaddr);
+		socket_server_idmask(ss, 0x7fffffff >> SHARD_BITS);
+		socket_server_reuseport(ss, REUSEPORT);
+		SOCKET_SERVER[i] = ss;
+	}
+}
+
+int
+skynet_socket_shard() {
+	return SHARD_N;
 }
 
 void
 skynet_socket_exit() {
-	socket_server_exit(SOCKET_SERVER);
+	int i;
+	for (i=0;i<SHARD_N;i++) {
+		socket_server_exit(SOCKET_SERVER[i]);
+	}
 }
 
 void
 skynet_socket_free() {
-	socket_server_release(SOCKET_SERVER);
-	SOCKET_SERVER = NULL;
+	int i;
+	for (i=0;i<SHARD_N;i++) {
+		socket_server_release(SOCKET_SERVER[i]);
+		SOCKET_SERVER[i] = NULL;
+	}
+	while (LISTEN_GROUP) {
+		struct listen_group * g = LISTEN_GROUP;
+		LISTEN_GROUP = g->next;
+		skynet_free(g);
+	}
+}
+
+// return the id reported to the service : the first listening socket of the group
+static int
+listen_group_id(int id) {
+	int ret = id;
+	spinlock_lock(&LISTEN_LOCK);
+	struct listen_group * g;
+	for (g = LISTEN_GROUP; g; g = g->next) {
+		if (g->id[SHARD(id)] == id) {
+			ret = g->id[0];
+			break;
+		}
+	}
+	spinlock_unlock(&LISTEN_LOCK);
+	return ret;
+}
+
+// find the group of the first id, remove it from the list if remove is true
+static struct listen_group *
+listen_group_find(int id, bool remove) {
+	spinlock_lock(&LISTEN_LOCK);
+	struct listen_group ** prev = &LISTEN_GROUP;
+	struct listen_group * g;
+	for (g = LISTEN_GROUP; g; g = g->next) {
+		if (g->id[0] == id) {
+			if (remove) {
+				*prev = g->next;
+			}
+			break;
+		}
+		prev = &g->next;
+	}
+	spinlock_unlock(&LISTEN_LOCK);
+	return g;
 }
 
 // mainloop thread
-static void
+// return 1 if the socket should be paused (see skynet_mq_flowpause)
+static int
 forward_message(int type, bool padding, struct socket_message * result) {
 	struct skynet_socket_message *sm;
 	size_t sz = sizeof(*sm);
@@ -62,26 +191,40 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.data = sm;
 	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
 	
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+	int ret;
+	if (type == SKYNET_SOCKET_TYPE_DATA || type == SKYNET_SOCKET_TYPE_UDP) {
+		ret = skynet_context_pushflow((uint32_t)result->opaque, &message);
+	} else {
+		ret = skynet_context_push((uint32_t)result->opaque, &message);
+	}
+	if (ret < 0) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
-		skynet_free(sm->buffer);
+		socket_server_buffer_free(sm->buffer);
 		skynet_free(sm);
 	}
+	return ret;
 }
 
 int 
-skynet_socket_poll() {
-	struct socket_server *ss = SOCKET_SERVER;
+skynet_socket_poll(int shard) {
+	struct socket_server *ss = SOCKET_SERVER[shard];
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
 	int type = socket_server_poll(ss, &result, &more);
+	int id = result.id;
+	if (type != -1) {
+		result.id = GLOBAL_ID(result.id, shard);
+	}
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
 	case SOCKET_DATA:
-		forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result);
+		if (forward_message(SKYNET_SOCKET_TYPE_DATA, false, &result) > 0) {
+			// the queue of the service is too long, stop reading until it resumes
+			socket_server_pause(ss, id);
+		}
 		break;
 	case SOCKET_CLOSE:
 		forward_message(SKYNET_SOCKET_TYPE_CLOSE, false, &result);
@@ -93,10 +236,16 @@ skynet_socket_poll() {
 		forward_message(SKYNET_SOCKET_TYPE_ERROR, true, &result);
 		break;
 	case SOCKET_ACCEPT:
+		result.ud = GLOBAL_ID(result.ud, shard);
+		if (REUSEPORT) {
+			result.id = listen_group_id(result.id);
+		}
 		forward_message(SKYNET_SOCKET_TYPE_ACCEPT, true, &result);
 		break;
 	case SOCKET_UDP:
-		forward_message(SKYNET_SOCKET_TYPE_UDP, false, &result);
+		if (forward_message(SKYNET_SOCKET_TYPE_UDP, false, &result) > 0) {
+			socket_server_pause(ss, id);
+		}
 		break;
 	default:
 		skynet_error(NULL, "Unknown socket message type %d.",type);
@@ -126,64 +275,188 @@ check_wsz(struct skynet_context *ctx, int id, void *buffer, int64_t wsz) {
 
 int
 skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz) {
-	int64_t wsz = socket_server_send(SOCKET_SERVER, id, buffer, sz);
+	int lid = id;
+	struct socket_server *ss = shard_server(&lid);
+	int64_t wsz = socket_server_send(ss, lid, buffer, sz);
 	return check_wsz(ctx, id, buffer, wsz);
 }
 
 void
 skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz) {
-	socket_server_send_lowpriority(SOCKET_SERVER, id, buffer, sz);
+	struct socket_server *ss = shard_server(&id);
+	socket_server_send_lowpriority(ss, id, buffer, sz);
+}
+
+static int
+listen_reuseport(uint32_t source, const char *host, int port, int backlog) {
+	struct listen_group * g = skynet_malloc(sizeof(*g));
+	int i;
+	for (i=0;i<SHARD_N;i++) {
+		int id = socket_server_listen(SOCKET_SERVER[i], source, host, port, backlog);
+		if (id < 0) {
+			int j;
+			for (j=0;j<i;j++) {
+				socket_server_close(SOCKET_SERVER[j], source, LOCAL_ID(g->id[j]));
+			}
+			skynet_free(g);
+			return -1;
+		}
+		g->id[i] = GLOBAL_ID(id, i);
+	}
+	spinlock_lock(&LISTEN_LOCK);
+	g->next = LISTEN_GROUP;
+	LISTEN_GROUP = g;
+	spinlock_unlock(&LISTEN_LOCK);
+	return g->id[0];
 }
 
 int 
 skynet_socket_listen(struct skynet_context *ctx, const char *host, int port, int backlog) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_listen(SOCKET_SERVER, source, host, port, backlog);
+	if (REUSEPORT) {
+		return listen_reuseport(source, host, port, backlog);
+	}
+	int id = socket_server_listen(SOCKET_SERVER[0], source, host, port, backlog);
+	return GLOBAL_ID(id, 0);
 }
 
 int 
 skynet_socket_connect(struct skynet_context *ctx, const char *host, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_connect(SOCKET_SERVER, source, host, port);
+	int shard = shard_next();
+	int id = socket_server_connect(SOCKET_SERVER[shard], source, host, port);
+	return GLOBAL_ID(id, shard);
 }
 
 int 
 skynet_socket_bind(struct skynet_context *ctx, int fd) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_bind(SOCKET_SERVER, source, fd);
+	int shard = shard_next();
+	int id = socket_server_bind(SOCKET_SERVER[shard], source, fd);
+	return GLOBAL_ID(id, shard);
 }
 
 void 
 skynet_socket_close(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_close(SOCKET_SERVER, source, id);
+	if (REUSEPORT && SHARD(id) == 0) {
+		struct listen_group * g = listen_group_find(id, true);
+		if (g) {
+			int i;
+			for (i=1;i<SHARD_N;i++) {
+				socket_server_close(SOCKET_SERVER[i], source, LOCAL_ID(g->id[i]));
+			}
+			skynet_free(g);
+		}
+	}
+	struct socket_server *ss = shard_server(&id);
+	socket_server_close(ss, source, id);
 }
 
 void 
 skynet_socket_start(struct skynet_context *ctx, int id) {
 	uint32_t source = skynet_context_handle(ctx);
-	socket_server_start(SOCKET_SERVER, source, id);
+	if (REUSEPORT && SHARD(id) == 0) {
+		struct listen_group * g = listen_group_find(id, false);
+		if (g) {
+			int i;
+			for (i=1;i<SHARD_N;i++) {
+				socket_server_start(SOCKET_SERVER[i], source, LOCAL_ID(g->id[i]));
+			}
+		}
+	}
+	struct socket_server *ss = shard_server(&id);
+	socket_server_start(ss, source, id);
 }
 
 void
 skynet_socket_nodelay(struct skynet_context *ctx, int id) {
-	socket_server_nodelay(SOCKET_SERVER, id);
+	struct socket_server *ss = shard_server(&id);
+	socket_server_nodelay(ss, id);
+}
+
+void
+skynet_socket_resume(uint32_t handle) {
+	int i;
+	for (i=0;i<SHARD_N;i++) {
+		socket_server_resume(SOCKET_SERVER[i], handle);
+	}
+}
+
+int
+skynet_socket_listenstat(struct skynet_context *ctx, int id, struct skynet_socket_listenstat *stat) {
+	int ids[MAX_SHARD];
+	int n = 0;
+	spinlock_lock(&LISTEN_LOCK);
+	struct listen_group * g;
+	for (g = LISTEN_GROUP; g; g = g->next) {
+		if (g->id[0] == id) {
+			for (n=0;n<SHARD_N;n++) {
+				ids[n] = g->id[n];
+			}
+			break;
+		}
+	}
+	spinlock_unlock(&LISTEN_LOCK);
+	if (n == 0) {
+		ids[0] = id;
+		n = 1;
+	}
+	memset(stat, 0, sizeof(*stat));
+	int i;
+	int found = 0;
+	int backlog = 1;
+	for (i=0;i<n;i++) {
+		int lid = ids[i];
+		struct socket_server *ss = shard_server(&lid);
+		struct socket_listen_stat st;
+		if (lid < 0 || socket_server_listenstat(ss, lid, &st)) {
+			continue;
+		}
+		found = 1;
+		stat->accepted += st.accepted;
+		stat->dropped += st.dropped;
+		stat->rate += st.rate;
+		if (st.backlog < 0) {
+			backlog = 0;
+		} else {
+			stat->backlog += st.backlog;
+			stat->backlog_max += st.backlog_max;
+		}
+	}
+	if (!backlog) {
+		stat->backlog = -1;
+		stat->backlog_max = -1;
+	}
+	return found ? 0 : 1;
+}
+
+void
+skynet_socket_flowcontrol(struct skynet_context *ctx, int high, int low) {
+	if (skynet_context_flowcontrol(ctx, high, low)) {
+		skynet_socket_resume(skynet_context_handle(ctx));
+	}
 }
 
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
-	return socket_server_udp(SOCKET_SERVER, source, addr, port);
+	int shard = shard_next();
+	int id = socket_server_udp(SOCKET_SERVER[shard], source, addr, port);
+	return GLOBAL_ID(id, shard);
 }
 
 int 
 skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port) {
-	return socket_server_udp_connect(SOCKET_SERVER, id, addr, port);
+	struct socket_server *ss = shard_server(&id);
+	return socket_server_udp_connect(ss, id, addr, port);
 }
 
 int 
 skynet_socket_udp_send(struct skynet_context *ctx, int id, const char * address, const void *buffer, int sz) {
-	int64_t wsz = socket_server_udp_send(SOCKET_SERVER, id, (const struct socket_udp_address *)address, buffer, sz);
+	int lid = id;
+	struct socket_server *ss = shard_server(&lid);
+	int64_t wsz = socket_server_udp_send(ss, lid, (const struct socket_udp_address *)address, buffer, sz);
 	return check_wsz(ctx, id, (void *)buffer, wsz);
 }
 
@@ -197,5 +470,11 @@ skynet_socket_udp_address(struct skynet_socket_message *msg, int *addrsz) {
 	sm.opaque = 0;
 	sm.ud = msg->ud;
 	sm.data = msg->buffer;
-	return (const char *)socket_server_udp_address(SOCKET_SERVER, &sm, addrsz);
+	struct socket_server *ss = shard_server(&sm.id);
+	return (const char *)socket_server_udp_address(ss, &sm, addrsz);
+}
+
+void
+skynet_socket_free_buffer(void *buffer) {
+	socket_server_buffer_free(buffer);
 }
@@ -1,6 +1,8 @@
 #ifndef skynet_socket_h
 #define skynet_socket_h
 
+#include <stdint.h>
+
 struct skynet_context;
 
 #define SKYNET_SOCKET_TYPE_DATA 1
@@ -18,10 +20,19 @@ struct skynet_socket_message {
 	char * buffer;
 };
 
-void skynet_socket_init();
+struct skynet_socket_listenstat {
+	uint64_t accepted;
+	uint64_t dropped;	// accepted but closed (no socket slot), or accept failed (EMFILE/ENFILE)
+	int rate;	// accepted in the last second
+	int backlog;	// connections in the accept queue, -1 if unknown
+	int backlog_max;
+};
+
+void skynet_socket_init(int shard, int readbudget, int reuseport, int maxsocket, int acceptaddr);
+int skynet_socket_shard();
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int shard);
 
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz);
 void skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz);
@@ -31,10 +42,20 @@ int skynet_socket_bind(struct skynet_context *ctx, int fd);
 void skynet_socket_close(struct skynet_context *ctx, int id);
 void skynet_socket_start(struct skynet_context *ctx, int id);
 void skynet_socket_nodelay(struct skynet_context *ctx, int id);
+// Pause reading the sockets which send data to the service when its message queue is longer than high,
+// and resume them when it's not longer than low. high = 0 turns it off.
+void skynet_socket_flowcontrol(struct skynet_context *ctx, int high, int low);
+// resume reading the sockets paused by flow control of the service
+void skynet_socket_resume(uint32_t handle);
+// the counters of a listening socket (of all the shards with reuseport), return 0 for success
+int skynet_socket_listenstat(struct skynet_context *ctx, int id, struct skynet_socket_listenstat *stat);
 
 int skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port);
 int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * addr, int port);
 int skynet_socket_udp_send(struct skynet_context *ctx, int id, const char * address, const void *buffer, int sz);
 const char * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
 
+// free the buffer of SKYNET_SOCKET_TYPE_DATA and SKYNET_SOCKET_TYPE_UDP message
+void skynet_socket_free_buffer(void *buffer);
+
 #endif
@@ -9,6 +9,8 @@
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "spinlock.h"
+#include "park.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -20,9 +22,11 @@
 struct monitor {
 	int count; // number of worker threads
 	struct skynet_monitor ** m; // m[i] is a pointer to skynet_monitor, each worker thread has a skynet_monitor
-	pthread_cond_t cond;
-	pthread_mutex_t mutex;
-	int sleep;
+	struct park * park; // park[i] is used to park/unpark worker thread i
+	int * idle; // the stack of parked worker ids
+	int sleep; // the size of idle stack
+	int spin; // how many times a worker polls the empty queue before park
+	struct spinlock lock; // for idle stack
 	int quit;
 };
 
@@ -32,6 +36,11 @@ struct worker_parm {
 	int weight;
 };
 
+struct socket_parm {
+	struct monitor *m;
+	int shard;
+};
+
 #define CHECK_ABORT if (skynet_context_total()==0) break;
 
 static void
@@ -42,31 +51,90 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
+// unpark at most n workers, the worker parked last (its cache is hotter) first
+static void
+wakeup_n(struct monitor *m, int n) {
+	while (n > 0) {
+		SPIN_LOCK(m)
+		if (m->sleep == 0) {
+			SPIN_UNLOCK(m)
+			break;
+		}
+		int id = m->idle[--m->sleep];
+		SPIN_UNLOCK(m)
+		park_unpark(&m->park[id]);
+		--n;
+	}
+}
+
+// wake up as many workers as the queues waiting for dispatch, no more
+static void
+wakeup(struct monitor *m) {
+	// the queues are pushed before, don't read the idle stack before it
+	__sync_synchronize();
+	if (m->sleep > 0) {
+		int n = skynet_globalmq_length();
+		if (n > 0) {
+			wakeup_n(m, n);
+		}
+	}
+}
+
+// remove worker id from idle stack, return 0 if it has been popped by others
+static int
+unpark_self(struct monitor *m, int id) {
+	int i;
+	int ret = 0;
+	SPIN_LOCK(m)
+	for (i=m->sleep-1;i>=0;i--) {
+		if (m->idle[i] == id) {
+			memmove(&m->idle[i], &m->idle[i+1], (m->sleep - i - 1) * sizeof(int));
+			--m->sleep;
+			ret = 1;
+			break;
+		}
+	}
+	SPIN_UNLOCK(m)
+	return ret;
+}
+
 static void
-wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
+park_worker(struct monitor *m, int id) {
+	struct park *p = &m->park[id];
+	park_reset(p);
+	SPIN_LOCK(m)
+	m->idle[m->sleep++] = id;
+	SPIN_UNLOCK(m)
+	__sync_synchronize();
+	// A queue may be pushed after our last pop and before we are in the idle stack, check again.
+	if (m->quit || skynet_globalmq_length() > 0) {
+		if (unpark_self(m, id)) {
+			return;
+		}
+		// someone popped us, wait for its signal (it will come soon)
 	}
+	park_wait(p);
 }
 
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	struct socket_parm *sp = p;
+	struct monitor * m = sp->m;
+	int shard = sp->shard;
 
   // set socket thread's specific data to THREAD_SOCKET
 	skynet_initthread(THREAD_SOCKET);
 
   // continue to poll socket and signal worker thread to process
 	for (;;) {
-		int r = skynet_socket_poll();
+		int r = skynet_socket_poll(shard);
 		if (r==0)
 			break;
 		if (r<0) {
 			CHECK_ABORT
 			continue;
 		}
-		wakeup(m,0);
+		wakeup(m);
 	}
 	return NULL;
 }
@@ -78,8 +146,12 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
+	for (i=0;i<n;i++) {
+		park_destroy(&m->park[i]);
+	}
+	SPIN_DESTROY(m)
+	skynet_free(m->park);
+	skynet_free(m->idle);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -124,17 +196,16 @@ thread_timer(void *p) {
 	for (;;) {
 		skynet_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1);
-		usleep(2500); // sleep 2.5s
+		wakeup(m);
+		skynet_timer_wait();
 	}
   
 	// wakeup socket thread
 	skynet_socket_exit();
 	// wakeup all worker thread
-	pthread_mutex_lock(&m->mutex);
 	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	__sync_synchronize();
+	wakeup_n(m, m->count);
 	return NULL;
 }
 
@@ -147,36 +218,40 @@ thread_worker(void *p) {
 	struct skynet_monitor *sm = m->m[id];
   // set worker thread's specific data to THREAD_WORKER
 	skynet_initthread(THREAD_WORKER);
+	skynet_globalmq_bind(id);
 	struct message_queue * q = NULL;
 	while (!m->quit) {
 		q = skynet_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
+			// spin a while before park, it's cheaper than the wakeup if messages come soon
+			int i;
+			for (i=0;i<m->spin && q == NULL && !m->quit;i++) {
+				q = skynet_context_message_dispatch(sm, NULL, weight);
+			}
+			if (q == NULL) {
 				// "spurious wakeup" is harmless,
 				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
+				park_worker(m, id);
 			}
+		} else if (m->sleep > 0 && skynet_globalmq_length() > 0) {
+			// more queues are waiting, wake up one more worker to help
+			wakeup_n(m, 1);
 		}
 	}
 	return NULL;
 }
 
 static void
-start(int thread) {
-	pthread_t pid[thread+3]; // worker threads + monitor + timer + socket thread
+start(int thread, int spin) {
+	int socket_thread = skynet_socket_shard();
+	pthread_t pid[thread+2+socket_thread]; // worker threads + monitor + timer + socket threads
 
   // alloc monitor and initialize it
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
 	m->count = thread; // count represents the number of worker threads
 	m->sleep = 0;
+	m->spin = spin;
 
   // alloc array of skynet_monitors and attach it to monitor->m
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
@@ -185,21 +260,24 @@ start(int thread) {
 		m->m[i] = skynet_monitor_new();
 	}
 
-  // initialize monitor's mutex and condition veriable
-	if (pthread_mutex_init(&m->mutex, NULL)) {
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
+  // initialize the parking of worker threads
+	m->park = skynet_malloc(thread * sizeof(struct park));
+	m->idle = skynet_malloc(thread * sizeof(int));
+	for (i=0;i<thread;i++) {
+		park_init(&m->park[i]);
 	}
+	SPIN_INIT(m)
 
   // create and run monitor, timer and socket threads
   // and pass monitor `m` as threading function's argument
 	create_thread(&pid[0], thread_monitor, m);
 	create_thread(&pid[1], thread_timer, m);
-	create_thread(&pid[2], thread_socket, m);
+	struct socket_parm sp[socket_thread];
+	for (i=0;i<socket_thread;i++) {
+		sp[i].m = m;
+		sp[i].shard = i;	// each socket thread polls its own socket server
+		create_thread(&pid[thread+2+i], thread_socket, &sp[i]);
+	}
 
   // for worker threads
 	static int weight[] = { 
@@ -223,11 +301,11 @@ start(int thread) {
     
     // create and run worker threads 
     // and pass worker_parm as threading function's argument
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		create_thread(&pid[i+2], thread_worker, &wp[i]);
 	}
 
   // wait all threads terminate
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+2+socket_thread;i++) {
 		pthread_join(pid[i], NULL); 
 	}
 
@@ -289,7 +367,14 @@ skynet_start(struct skynet_config * config) {
   skynet_handle_init(config->harbor);
 
   // alloc and init global queue Q
-	skynet_mq_init();
+  // config->worksteal: each worker thread owns a local run queue and steals from others when idle
+	skynet_mq_init(config->worksteal ? config->thread : 0);
+
+  // config->timeslice: microseconds per turn of a service, 0 means using the static weight below
+	skynet_context_timeslice(config->timeslice, config->thread);
+
+  // config->msgstat: record queue wait time and callback time of each message, see STAT command
+	skynet_context_msgstat(config->msgstat);
 
   // module_path: "cpath" default is "./cservice/?.so"
   // alloc and init global skynet modules M
@@ -298,10 +383,17 @@ skynet_start(struct skynet_config * config) {
 	skynet_module_init(config->module_path);
 
   // create and init system timer TI
-	skynet_timer_init();
+  // config->tick: millisecond per timer tick (1, 2, 5 or 10), default is 10
+  // config->timerfd: block the timer thread on a timerfd until the next deadline, instead of polling
+	skynet_timer_init(config->tick, config->timerfd);
   
   // create and init SOCKET_SERVER
-	skynet_socket_init();
+  // config->socket_thread: socket servers (shards) count, each one has its own poll and thread, default is 1 (at most 16)
+  // config->readbudget: keep reading a readable socket until EAGAIN or this many bytes, and forward them in one message. 0 (default) turns it off
+  // config->reuseport: listen in every shard with SO_REUSEPORT, so the accepts spread across the socket threads
+  // config->maxsocket: max sockets of each socket thread, the slots are allocated when needed. default is 65536
+  // config->acceptaddr: format the peer address for the accept messages, default is true
+	skynet_socket_init(config->socket_thread, config->readbudget, config->reuseport, config->maxsocket, config->acceptaddr);
 
   // config->logservice: "logservice" default module name is "logger"
   // config->logger: "logger" is used to config logging file, default is NULL using standard output
@@ -320,8 +412,9 @@ skynet_start(struct skynet_config * config) {
 	bootstrap(ctx, config->bootstrap);
   
   // config->thread: worker thread count, default is 8 (usually set to the real cores of your machine)
+  // config->spin: how many times an idle worker polls the queues before park, default is 0
   // start skynet: run monitor thread, timer thread, socket thread, and multiple worker threads
-	start(config->thread);
+	start(config->thread, config->spin);
   
 	// harbor_exit may call socket send, so it should exit before socket_free
 	skynet_harbor_exit();
@@ -0,0 +1,123 @@
+#include "skynet.h"
+
+#include "skynet_stat.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Log-linear histogram (like HdrHistogram) : each power of 2 is split into 4 sub buckets,
+// so the error of a percentile is less than 25%.
+// Only the worker dispatching the service writes it, no lock or atomic is needed.
+// Readers (STAT command) may see a slightly inconsistent snapshot, it's ok for statistics.
+
+#define SUB_BITS 2
+#define SUB_BUCKET (1 << SUB_BITS)
+#define MAX_EXP 40	// 2^40 ns is about 18 minutes
+#define BUCKET ((MAX_EXP - SUB_BITS + 1) * SUB_BUCKET + SUB_BUCKET)
+#define PTYPE_COUNT 256
+
+struct histogram {
+	uint64_t max;
+	uint32_t bucket[BUCKET];
+};
+
+struct skynet_stat {
+	uint64_t total;
+	struct histogram h[2];	// STAT_WAIT, STAT_EXEC
+	uint32_t count[PTYPE_COUNT];
+};
+
+struct skynet_stat *
+skynet_stat_new(void) {
+	struct skynet_stat * s = skynet_malloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	return s;
+}
+
+void
+skynet_stat_delete(struct skynet_stat *s) {
+	skynet_free(s);
+}
+
+void
+skynet_stat_reset(struct skynet_stat *s) {
+	memset(s, 0, sizeof(*s));
+}
+
+static inline int
+bucket_index(uint64_t v) {
+	if (v < SUB_BUCKET) {
+		return (int)v;
+	}
+	int e = 63 - __builtin_clzll(v);
+	if (e > MAX_EXP) {
+		return BUCKET - 1;
+	}
+	return (e - SUB_BITS + 1) * SUB_BUCKET + (int)((v >> (e - SUB_BITS)) & (SUB_BUCKET - 1));
+}
+
+// the upper bound of the bucket
+static uint64_t
+bucket_value(int idx) {
+	if (idx < SUB_BUCKET) {
+		return idx;
+	}
+	int e = idx / SUB_BUCKET + SUB_BITS - 1;
+	int m = idx % SUB_BUCKET;
+	return ((uint64_t)(SUB_BUCKET + m + 1) << (e - SUB_BITS)) - 1;
+}
+
+static inline void
+record(struct histogram *h, uint64_t v) {
+	++h->bucket[bucket_index(v)];
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+void
+skynet_stat_message(struct skynet_stat *s, int type, uint64_t wait, uint64_t exec) {
+	++s->total;
+	++s->count[type & (PTYPE_COUNT-1)];
+	record(&s->h[STAT_WAIT], wait);
+	record(&s->h[STAT_EXEC], exec);
+}
+
+uint64_t
+skynet_stat_count(struct skynet_stat *s, int type) {
+	if (type < 0) {
+		return s->total;
+	}
+	return s->count[type & (PTYPE_COUNT-1)];
+}
+
+uint64_t
+skynet_stat_percentile(struct skynet_stat *s, int what, double percent) {
+	struct histogram *h = &s->h[what];
+	uint64_t total = 0;
+	int i;
+	for (i=0;i<BUCKET;i++) {
+		total += h->bucket[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(total * percent / 100);
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	uint64_t n = 0;
+	for (i=0;i<BUCKET;i++) {
+		n += h->bucket[i];
+		if (n > rank) {
+			uint64_t v = bucket_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+uint64_t
+skynet_stat_max(struct skynet_stat *s, int what) {
+	return s->h[what].max;
+}
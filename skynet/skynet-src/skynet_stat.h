@@ -0,0 +1,23 @@
+#ifndef SKYNET_STAT_H
+#define SKYNET_STAT_H
+
+#include <stdint.h>
+
+#define STAT_WAIT 0
+#define STAT_EXEC 1
+
+struct skynet_stat;
+
+struct skynet_stat * skynet_stat_new(void);
+void skynet_stat_delete(struct skynet_stat *);
+void skynet_stat_reset(struct skynet_stat *);
+// wait and exec are in nanoseconds
+void skynet_stat_message(struct skynet_stat *, int type, uint64_t wait, uint64_t exec);
+
+// type < 0 for all types
+uint64_t skynet_stat_count(struct skynet_stat *, int type);
+// percent is in [0, 100], return nanoseconds
+uint64_t skynet_stat_percentile(struct skynet_stat *, int what, double percent);
+uint64_t skynet_stat_max(struct skynet_stat *, int what);
+
+#endif
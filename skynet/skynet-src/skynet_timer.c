@@ -7,16 +7,21 @@
 #include "spinlock.h"
 
 #include <time.h>
+#include <stdio.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #if defined(__APPLE__)
 #include <sys/time.h>
 #endif
 
-typedef void (*timer_execute_func)(void *ud,void *arg);
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#define HAVE_TIMERFD
+#endif
 
 #define TIME_NEAR_SHIFT 8
 #define TIME_NEAR (1 << TIME_NEAR_SHIFT)
@@ -25,6 +30,14 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
+#define DEFAULT_TICK 10	// millisecond, 1/100 second
+#define DEFAULT_HASH_SIZE 1024
+
+// state of timerfd
+#define ARM_NONE 0	// no timer, block until interrupt
+#define ARM_DEADLINE 1	// armed at T->armed
+#define ARM_INTERRUPT 2	// wake the timer thread as soon as possible
+
 struct timer_event {
 	uint32_t handle;
 	int session;
@@ -32,7 +45,10 @@ struct timer_event {
 
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *hash_next;	// index by (handle, session) for cancel
 	uint32_t expire;
+	int cancel;
+	struct timer_event event;
 };
 
 struct link_list {
@@ -43,16 +59,34 @@ struct link_list {
 struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
+	// occupancy bitmaps of near[] and t[][], for fast-forward across empty slots
+	uint64_t near_bits[TIME_NEAR / 64];
+	uint64_t level_bits[4];
 	struct spinlock lock;
 	uint32_t time;
 	uint32_t current;
 	uint32_t starttime;
+	uint32_t origin_cs;
+	int tick;	// millisecond per tick
+	uint64_t elapsed;	// ticks since start
 	uint64_t current_point;
 	uint64_t origin_point;
+	int hash_size;
+	int hash_count;
+	struct timer_node **hash;
+	int timerfd;	// -1 : poll every quarter of tick
+	// T->time may be far behind the clock when the timer thread blocks on timerfd,
+	// so timer_add counts from the clock: target is T->time at target_point.
+	uint32_t target;
+	uint64_t target_point;
+	int arm_state;
+	uint32_t armed;	// the time (in T->time) of the next deadline
 };
 
 static struct timer * TI = NULL;
 
+static uint64_t gettime();
+
 static inline struct timer_node *
 link_clear(struct link_list *list) {
 	struct timer_node * ret = list->head.next;
@@ -63,19 +97,88 @@ link_clear(struct link_list *list) {
 }
 
 static inline void
-link(struct link_list *list,struct timer_node *node) {
+link_node(struct link_list *list,struct timer_node *node) {
 	list->tail->next = node;
 	list->tail = node;
 	node->next=0;
 }
 
+static inline uint32_t
+hash_event(struct timer_event *ev) {
+	return (ev->handle * 2654435761u) ^ (uint32_t)ev->session;
+}
+
+static void
+hash_expand(struct timer *T) {
+	int size = T->hash_size * 2;
+	struct timer_node **hash = (struct timer_node **)skynet_malloc(size * sizeof(*hash));
+	memset(hash, 0, size * sizeof(*hash));
+	int i;
+	for (i=0;i<T->hash_size;i++) {
+		struct timer_node *node = T->hash[i];
+		while (node) {
+			struct timer_node *next = node->hash_next;
+			struct timer_node **slot = &hash[hash_event(&node->event) & (size-1)];
+			node->hash_next = *slot;
+			*slot = node;
+			node = next;
+		}
+	}
+	skynet_free(T->hash);
+	T->hash = hash;
+	T->hash_size = size;
+}
+
+static void
+hash_insert(struct timer *T, struct timer_node *node) {
+	if (T->hash_count >= T->hash_size) {
+		hash_expand(T);
+	}
+	struct timer_node **slot = &T->hash[hash_event(&node->event) & (T->hash_size-1)];
+	node->hash_next = *slot;
+	*slot = node;
+	++T->hash_count;
+}
+
+// remove the node of (handle, session) from hash, and return it
+static struct timer_node *
+hash_remove(struct timer *T, struct timer_event *ev) {
+	struct timer_node **slot = &T->hash[hash_event(ev) & (T->hash_size-1)];
+	while (*slot) {
+		struct timer_node *node = *slot;
+		if (node->event.handle == ev->handle && node->event.session == ev->session) {
+			*slot = node->hash_next;
+			--T->hash_count;
+			return node;
+		}
+		slot = &node->hash_next;
+	}
+	return NULL;
+}
+
+// remove the node itself from hash, the sessions may repeat (skynet_timeout accepts any session)
+static void
+hash_unlink(struct timer *T, struct timer_node *node) {
+	struct timer_node **slot = &T->hash[hash_event(&node->event) & (T->hash_size-1)];
+	while (*slot) {
+		if (*slot == node) {
+			*slot = node->hash_next;
+			--T->hash_count;
+			return;
+		}
+		slot = &(*slot)->hash_next;
+	}
+}
+
 static void
 add_node(struct timer *T,struct timer_node *node) {
 	uint32_t time=node->expire;
 	uint32_t current_time=T->time;
 	
 	if ((time|TIME_NEAR_MASK)==(current_time|TIME_NEAR_MASK)) {
-		link(&T->near[time&TIME_NEAR_MASK],node);
+		int idx = time&TIME_NEAR_MASK;
+		link_node(&T->near[idx],node);
+		T->near_bits[idx / 64] |= (uint64_t)1 << (idx % 64);
 	} else {
 		int i;
 		uint32_t mask=TIME_NEAR << TIME_LEVEL_SHIFT;
@@ -86,26 +189,66 @@ add_node(struct timer *T,struct timer_node *node) {
 			mask <<= TIME_LEVEL_SHIFT;
 		}
 
-		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+		int idx = (time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK;
+		link_node(&T->t[i][idx],node);
+		T->level_bits[i] |= (uint64_t)1 << idx;
 	}
 }
 
+// call it with lock T
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+timer_interrupt(struct timer *T) {
+#ifdef HAVE_TIMERFD
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_nsec = 1;
+	timerfd_settime(T->timerfd, 0, &spec, NULL);
+	T->arm_state = ARM_INTERRUPT;
+#endif
+}
+
+static void
+timer_add(struct timer *T,struct timer_event *event,uint32_t tick) {
+	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node));
+	node->event = *event;
+	node->cancel = 0;
 
 	SPIN_LOCK(T);
 
-		node->expire=time+T->time;
+		if (T->timerfd >= 0) {
+			node->expire=tick+T->target+(uint32_t)(gettime()-T->target_point);
+		} else {
+			node->expire=tick+T->time;
+		}
 		add_node(T,node);
+		hash_insert(T,node);
+		if (T->timerfd >= 0) {
+			if (T->arm_state == ARM_NONE ||
+				(T->arm_state == ARM_DEADLINE && (int32_t)(node->expire - T->armed) < 0)) {
+				// earlier than the deadline, let the timer thread arm it again
+				timer_interrupt(T);
+			}
+		}
+
+	SPIN_UNLOCK(T);
+}
 
+// The cancelled node stays in the wheel until it expires, but it will not send the message.
+static int
+timer_cancel(struct timer *T,struct timer_event *event) {
+	SPIN_LOCK(T);
+	struct timer_node *node = hash_remove(T, event);
+	if (node) {
+		node->cancel = 1;
+	}
 	SPIN_UNLOCK(T);
+	return node != NULL;
 }
 
 static void
 move_list(struct timer *T, int level, int idx) {
 	struct timer_node *current = link_clear(&T->t[level][idx]);
+	T->level_bits[level] &= ~((uint64_t)1 << idx);
 	while (current) {
 		struct timer_node *temp=current->next;
 		add_node(T,current);
@@ -139,15 +282,17 @@ timer_shift(struct timer *T) {
 static inline void
 dispatch_list(struct timer_node *current) {
 	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
-		struct skynet_message message;
-		message.source = 0;
-		message.session = event->session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+		if (!current->cancel) {
+			struct timer_event * event = &current->event;
+			struct skynet_message message;
+			message.source = 0;
+			message.session = event->session;
+			message.data = NULL;
+			message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+
+			skynet_context_push(event->handle, &message);
+		}
 
-		skynet_context_push(event->handle, &message);
-		
 		struct timer_node * temp = current;
 		current=current->next;
 		skynet_free(temp);	
@@ -160,6 +305,14 @@ timer_execute(struct timer *T) {
 	
 	while (T->near[idx].head.next) {
 		struct timer_node *current = link_clear(&T->near[idx]);
+		T->near_bits[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+		struct timer_node *node;
+		for (node = current; node; node = node->next) {
+			// the cancelled nodes are removed from hash already
+			if (!node->cancel) {
+				hash_unlink(T, node);
+			}
+		}
 		SPIN_UNLOCK(T);
 		// dispatch_list don't need lock T
 		dispatch_list(current);
@@ -167,26 +320,85 @@ timer_execute(struct timer *T) {
 	}
 }
 
+// the lowest set bit above pos, or -1
+static inline int
+next_bit(uint64_t bits, int pos) {
+	if (pos >= 63) {
+		return -1;
+	}
+	bits &= ~(uint64_t)0 << (pos + 1);
+	return bits ? __builtin_ctzll(bits) : -1;
+}
+
+// How many ticks to the next time that timer_shift/timer_execute has something to do:
+// a non-empty near slot, or a level slot to cascade. 0 means nothing till the end of time.
+static uint64_t
+timer_next(struct timer *T) {
+	uint32_t ct = T->time;
+	int idx = ct & TIME_NEAR_MASK;
+	int i;
+	for (i=idx/64;i<TIME_NEAR/64;i++) {
+		int n = next_bit(T->near_bits[i], i == idx/64 ? idx % 64 : -1);
+		if (n >= 0) {
+			return i*64 + n - idx;
+		}
+	}
+	int shift = TIME_NEAR_SHIFT;
+	for (i=0;i<4;i++) {
+		int n = next_bit(T->level_bits[i], (ct >> shift) & TIME_LEVEL_MASK);
+		if (n >= 0) {
+			// the slot n cascades when the lower bits are all zero
+			uint64_t high = (uint64_t)ct >> (shift + TIME_LEVEL_SHIFT) << (shift + TIME_LEVEL_SHIFT);
+			return high + ((uint64_t)n << shift) - ct;
+		}
+		shift += TIME_LEVEL_SHIFT;
+	}
+	if (T->level_bits[3]) {
+		// time rewind, see timer_shift
+		return ((uint64_t)1 << 32) - ct;
+	}
+	return 0;
+}
+
+// advance the wheel diff ticks, jump across the ticks which have no timer
 static void 
-timer_update(struct timer *T) {
+timer_update(struct timer *T, uint32_t diff, uint64_t point) {
 	SPIN_LOCK(T);
 
+	T->target = T->time + diff;
+	T->target_point = point;
+
 	// try to dispatch timeout 0 (rare condition)
 	timer_execute(T);
 
-	// shift time first, and then dispatch timer message
-	timer_shift(T);
+	while (diff > 0) {
+		uint64_t step = timer_next(T);
+		if (step == 0 || step > diff) {
+			T->time += diff;
+			break;
+		}
+		T->time += (uint32_t)(step - 1);
+		diff -= (uint32_t)step;
 
-	timer_execute(T);
+		// shift time first, and then dispatch timer message
+		timer_shift(T);
+
+		timer_execute(T);
+	}
 
 	SPIN_UNLOCK(T);
 }
 
 static struct timer *
-timer_create_timer() {
+timer_create_timer(int tick) {
 	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
 	memset(r,0,sizeof(*r));
 
+	r->tick = tick;
+	r->hash_size = DEFAULT_HASH_SIZE;
+	r->hash = (struct timer_node **)skynet_malloc(r->hash_size * sizeof(struct timer_node *));
+	memset(r->hash, 0, r->hash_size * sizeof(struct timer_node *));
+
 	int i,j;
 
 	for (i=0;i<TIME_NEAR;i++) {
@@ -206,9 +418,9 @@ timer_create_timer() {
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
-	if (time <= 0) {
+static int
+timeout_tick(uint32_t handle, uint32_t tick, int session) {
+	if (tick == 0) {
 		struct skynet_message message;
 		message.source = 0;
 		message.session = session;
@@ -222,12 +434,37 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, tick);
 	}
 
 	return session;
 }
 
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	if (time <= 0) {
+		return timeout_tick(handle, 0, session);
+	}
+	return timeout_tick(handle, (uint32_t)time * (DEFAULT_TICK / TI->tick), session);
+}
+
+int
+skynet_timeout_ms(uint32_t handle, int ms, int session) {
+	if (ms <= 0) {
+		return timeout_tick(handle, 0, session);
+	}
+	// round up to tick
+	return timeout_tick(handle, ((uint32_t)ms + TI->tick - 1) / TI->tick, session);
+}
+
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer_event event;
+	event.handle = handle;
+	event.session = session;
+	return timer_cancel(TI, &event);
+}
+
 // centisecond: 1/100 second
 static void
 systime(uint32_t *sec, uint32_t *cs) {
@@ -244,8 +481,9 @@ systime(uint32_t *sec, uint32_t *cs) {
 #endif
 }
 
+// nanosecond of the clock which drives the timer
 static uint64_t
-gettime() {
+timer_clock() {
 	uint64_t t;
 #if !defined(__APPLE__)
 
@@ -257,17 +495,37 @@ gettime() {
 
 	struct timespec ti;
 	clock_gettime(CLOCK_TIMER, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * 1000000000;
+	t += ti.tv_nsec;
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	t = (uint64_t)tv.tv_sec * 100;
-	t += tv.tv_usec / 10000;
+	t = (uint64_t)tv.tv_sec * 1000000000;
+	t += (uint64_t)tv.tv_usec * 1000;
 #endif
 	return t;
 }
 
+// tick: TI->tick millisecond
+static uint64_t
+gettime() {
+	return timer_clock() / ((uint64_t)TI->tick * 1000000);
+}
+
+// monotonic time in nanoseconds, for measuring the cost of dispatch
+uint64_t
+skynet_gettime_ns(void) {
+#if !defined(__APPLE__)
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
 void
 skynet_updatetime(void) {
 	uint64_t cp = gettime();
@@ -279,15 +537,13 @@ skynet_updatetime(void) {
 		TI->current_point = cp;
 
 		uint32_t oc = TI->current;
-		TI->current += diff;
+		TI->elapsed += diff;
+		TI->current = TI->origin_cs + (uint32_t)(TI->elapsed * TI->tick / DEFAULT_TICK);
 		if (TI->current < oc) {
 			// when cs > 0xffffffff(about 497 days), time rewind
 			TI->starttime += 0xffffffff / 100;
 		}
-		int i;
-		for (i=0;i<diff;i++) {
-			timer_update(TI);
-		}
+		timer_update(TI, diff, cp);
 	}
 }
 
@@ -298,15 +554,88 @@ skynet_gettime_fixsec(void) {
 
 uint32_t 
 skynet_gettime(void) {
+	if (TI->timerfd >= 0) {
+		// TI->current is not updated when the timer thread is blocked, read the clock
+		return TI->origin_cs + (uint32_t)((gettime() - TI->origin_point) * TI->tick / DEFAULT_TICK);
+	}
 	return TI->current;
 }
 
+// Called by the timer thread after skynet_updatetime.
+// It sleeps a quarter of tick, or blocks on the timerfd until the next deadline.
+void
+skynet_timer_wait(void) {
+#ifdef HAVE_TIMERFD
+	struct timer *T = TI;
+	if (T->timerfd >= 0) {
+		struct itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		SPIN_LOCK(T);
+		if (skynet_context_total() == 0) {
+			// exiting, skynet_timer_interrupt may be called before lock
+			SPIN_UNLOCK(T);
+			return;
+		}
+		uint64_t step = timer_next(T);
+		if (step == 0) {
+			// disarm, only timer_add or skynet_timer_interrupt wake us up
+			T->arm_state = ARM_NONE;
+		} else {
+			T->arm_state = ARM_DEADLINE;
+			T->armed = T->time + (uint32_t)step;
+			uint64_t deadline = (T->current_point + step) * T->tick * 1000000;
+			uint64_t now = timer_clock();
+			uint64_t ns = deadline > now ? deadline - now : 1;
+			spec.it_value.tv_sec = ns / 1000000000;
+			spec.it_value.tv_nsec = ns % 1000000000;
+		}
+		timerfd_settime(T->timerfd, 0, &spec, NULL);
+		SPIN_UNLOCK(T);
+
+		uint64_t expirations;
+		if (read(T->timerfd, &expirations, sizeof(expirations)) < 0) {
+			// EINTR, skynet_updatetime will tell
+		}
+		return;
+	}
+#endif
+	usleep(TI->tick * 250);
+}
+
+// wake the timer thread (in timerfd mode) to check exit
+void
+skynet_timer_interrupt(void) {
+	struct timer *T = TI;
+	if (T->timerfd >= 0) {
+		SPIN_LOCK(T);
+		timer_interrupt(T);
+		SPIN_UNLOCK(T);
+	}
+}
+
 void 
-skynet_timer_init(void) {
-	TI = timer_create_timer();
+skynet_timer_init(int tick, int usefd) {
+	if (tick <= 0 || DEFAULT_TICK % tick != 0) {
+		fprintf(stderr, "Invalid tick %d (should be 1, 2, 5 or 10), use %d\n", tick, DEFAULT_TICK);
+		tick = DEFAULT_TICK;
+	}
+	TI = timer_create_timer(tick);
+	TI->timerfd = -1;
+	if (usefd) {
+#ifdef HAVE_TIMERFD
+		TI->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if (TI->timerfd < 0) {
+			fprintf(stderr, "timerfd_create failed, poll the timer instead\n");
+		}
+#else
+		fprintf(stderr, "timerfd is not supported, poll the timer instead\n");
+#endif
+	}
 	systime(&TI->starttime, &TI->current);
+	TI->origin_cs = TI->current;
 	uint64_t point = gettime();
 	TI->current_point = point;
 	TI->origin_point = point;
+	TI->target_point = point;
 }
 
@@ -3,11 +3,19 @@
 
 #include <stdint.h>
 
+// time is centisecond (1/100s), and the session is the id of timer
 int skynet_timeout(uint32_t handle, int time, int session);
+int skynet_timeout_ms(uint32_t handle, int ms, int session);
+// return 1 if the timer is removed before it fires
+int skynet_timeout_cancel(uint32_t handle, int session);
 void skynet_updatetime(void);
 uint32_t skynet_gettime(void);
 uint32_t skynet_gettime_fixsec(void);
+uint64_t skynet_gettime_ns(void);
 
-void skynet_timer_init(void);
+void skynet_timer_wait(void);
+void skynet_timer_interrupt(void);
+
+void skynet_timer_init(int tick, int usefd);
 
 #endif
@@ -10,6 +10,8 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 
+typedef int poll_fd;
+
 static bool 
 sp_invalid(int efd) {
 	return efd == -1;
@@ -42,23 +44,24 @@ sp_del(int efd, int sock) {
 }
 
 static void 
-sp_write(int efd, int sock, void *ud, bool enable) {
+sp_enable(int efd, int sock, void *ud, bool read_enable, bool write_enable) {
 	struct epoll_event ev;
-	ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+	ev.events = (read_enable ? EPOLLIN : 0) | (write_enable ? EPOLLOUT : 0);
 	ev.data.ptr = ud;
 	epoll_ctl(efd, EPOLL_CTL_MOD, sock, &ev);
 }
 
 static int 
-sp_wait(int efd, struct event *e, int max) {
+sp_wait(int efd, struct event *e, int max, int timeout) {
 	struct epoll_event ev[max];
-	int n = epoll_wait(efd , ev, max, -1);
+	int n = epoll_wait(efd , ev, max, timeout);
 	int i;
 	for (i=0;i<n;i++) {
 		e[i].s = ev[i].data.ptr;
 		unsigned flag = ev[i].events;
 		e[i].write = (flag & EPOLLOUT) != 0;
-		e[i].read = (flag & EPOLLIN) != 0;
+		// report error and hangup as readable, so the read gets the error (they are reported even if EPOLLIN is off)
+		e[i].read = (flag & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
 	}
 
 	return n;
@@ -10,6 +10,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+typedef int poll_fd;
+
 static bool 
 sp_invalid(int kfd) {
 	return kfd == -1;
@@ -56,18 +58,25 @@ sp_add(int kfd, int sock, void *ud) {
 }
 
 static void 
-sp_write(int kfd, int sock, void *ud, bool enable) {
-	struct kevent ke;
-	EV_SET(&ke, sock, EVFILT_WRITE, enable ? EV_ENABLE : EV_DISABLE, 0, 0, ud);
-	if (kevent(kfd, &ke, 1, NULL, 0, NULL) == -1) {
+sp_enable(int kfd, int sock, void *ud, bool read_enable, bool write_enable) {
+	struct kevent ke[2];
+	EV_SET(&ke[0], sock, EVFILT_READ, read_enable ? EV_ENABLE : EV_DISABLE, 0, 0, ud);
+	EV_SET(&ke[1], sock, EVFILT_WRITE, write_enable ? EV_ENABLE : EV_DISABLE, 0, 0, ud);
+	if (kevent(kfd, ke, 2, NULL, 0, NULL) == -1) {
 		// todo: check error
 	}
 }
 
 static int 
-sp_wait(int kfd, struct event *e, int max) {
+sp_wait(int kfd, struct event *e, int max, int timeout) {
 	struct kevent ev[max];
-	int n = kevent(kfd, NULL, 0, ev, max, NULL);
+	struct timespec ts, *pts = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		pts = &ts;
+	}
+	int n = kevent(kfd, NULL, 0, ev, max, pts);
 
 	int i;
 	for (i=0;i<n;i++) {
@@ -3,29 +3,33 @@
 
 #include <stdbool.h>
 
-typedef int poll_fd;
-
 struct event {
 	void * s;
 	bool read;
 	bool write;
 };
 
-static bool sp_invalid(poll_fd fd);
-static poll_fd sp_create();
-static void sp_release(poll_fd fd);
-static int sp_add(poll_fd fd, int sock, void *ud);
-static void sp_del(poll_fd fd, int sock);
-static void sp_write(poll_fd, int sock, void *ud, bool enable);
-static int sp_wait(poll_fd, struct event *e, int max);
-static void sp_nonblocking(int sock);
+// each backend defines poll_fd
 
 #ifdef __linux__
+#ifdef USE_IO_URING
+#include "socket_uring.h"
+#else
 #include "socket_epoll.h"
 #endif
+#endif
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #include "socket_kqueue.h"
 #endif
 
+static bool sp_invalid(poll_fd fd);
+static poll_fd sp_create();
+static void sp_release(poll_fd fd);
+static int sp_add(poll_fd fd, int sock, void *ud);
+static void sp_del(poll_fd fd, int sock);
+static void sp_enable(poll_fd, int sock, void *ud, bool read_enable, bool write_enable);
+static int sp_wait(poll_fd, struct event *e, int max, int timeout);	// timeout in ms, -1 : infinite
+static void sp_nonblocking(int sock);
+
 #endif
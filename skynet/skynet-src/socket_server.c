@@ -1,11 +1,18 @@
+#ifdef __linux__
+// recvmmsg / sendmmsg
+#define _GNU_SOURCE
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
 #include "atomic.h"
+#include "spinlock.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
@@ -15,12 +22,29 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #define MAX_INFO 128
-// MAX_SOCKET will be 2^MAX_SOCKET_P
-#define MAX_SOCKET_P 16
+// ids are hashed into 2^MIN_SOCKET_P to 2^MAX_SOCKET_P slots, see socket_server_maxsocket
+#define MIN_SOCKET_P 16
+#define MAX_SOCKET_P 24
+// the slot table is allocated in pages of 2^SLOT_PAGE_P slots, when the sockets in use need them
+#define SLOT_PAGE_P 10
 #define MAX_EVENT 64
 #define MIN_READ_BUFFER 64
+// max buffers gathered in one writev
+#ifdef IOV_MAX
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 1024
+#endif
 #define SOCKET_TYPE_INVALID 0
 #define SOCKET_TYPE_RESERVE 1
 #define SOCKET_TYPE_PLISTEN 2
@@ -32,11 +56,25 @@
 #define SOCKET_TYPE_BIND 8
 
 #define MAX_SOCKET (1<<MAX_SOCKET_P)
+#define SLOT_PAGE (1<<SLOT_PAGE_P)
+#define MAX_SLOT_PAGE (MAX_SOCKET >> SLOT_PAGE_P)
+
+// size of ctrl command ring, must be power of 2
+#define CMD_RING_SIZE 4096
+// max ctrl commands handled between two polls, so busy senders can't starve the socket events
+#define MAX_CMD_BATCH 256
+// max connections accepted for one readiness event of a listening socket, so the other events are not starved
+#define MAX_ACCEPT_BATCH 64
+
+// receive buffer pools : MIN_READ_BUFFER (64 bytes) << [0, RECV_CLASS)
+#define RECV_CLASS 11
+#define RECV_CLASS_CACHE (1024 * 1024)	// max bytes cached in each class
 
 #define PRIORITY_HIGH 0
 #define PRIORITY_LOW 1
 
-#define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
+#define HASH_ID(ss, id) (((unsigned)id) & (ss)->slot_mask)
+#define ID_TAG16(id) ((id>>MIN_SOCKET_P) & 0xffff)
 
 #define PROTOCOL_TCP 0
 #define PROTOCOL_UDP 1
@@ -46,6 +84,13 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+#ifdef __linux__
+// read and send udp packages in batches with recvmmsg/sendmmsg
+#define UDP_BATCH 16
+#else
+#define UDP_BATCH 1
+#endif
+
 struct write_buffer {
 	struct write_buffer * next;
 	void *buffer;
@@ -68,30 +113,93 @@ struct socket {
 	struct wb_list high;
 	struct wb_list low;
 	int64_t wb_size;
+	uint32_t sending;	// high 16 bits : id tag, low 16 bits : the send requests in the ctrl pipe
 	int fd;
 	int id;
 	uint16_t protocol;
 	uint16_t type;
+	bool reading;	// false when it's paused by socket_server_pause
+	bool writing;
 	union {
 		int size;
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
+		struct {
+			uint32_t accepted;
+			uint32_t dropped;
+			uint32_t second;	// time(NULL) of the last accept
+			uint32_t second_n;	// accepted in that second
+			uint32_t last_n;	// accepted in the second before
+		} listen;
 	} p;
+	// direct write (see socket_server_send) from worker threads
+	struct spinlock dw_lock;
+	int dw_offset;
+	const void * dw_buffer;
+	int dw_size;
+};
+
+struct cmd_slot {
+	uint32_t seq;
+	uint8_t type;
+	uint8_t len;
+	uint8_t buffer[256];
+};
+
+union sockaddr_all {
+	struct sockaddr s;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+};
+
+// the packages read by one recvmmsg, forward_message_udp reports them one by one
+struct udp_batch {
+	struct socket *s;
+	int n;
+	int index;
+#if UDP_BATCH > 1
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+#endif
+	socklen_t slen[UDP_BATCH];
+	int sz[UDP_BATCH];
+	union sockaddr_all addr[UDP_BATCH];
+};
+
+struct paused_socket {
+	int id;
+	uintptr_t opaque;	// the owner when it's paused
 };
 
 struct socket_server {
-	int recvctrl_fd;
+	int recvctrl_fd;	// doorbell (eventfd, or the read side of a pipe)
 	int sendctrl_fd;
 	int checkctrl;
+	int cmd_batch;
+	uint32_t cmd_head;	// read by socket thread only
+	uint32_t cmd_tail;
+	int cmd_pending;
+	struct cmd_slot cmd[CMD_RING_SIZE];
 	poll_fd event_fd;
-	int alloc_id;
+	unsigned alloc_id;
+	unsigned slot_mask;	// max sockets - 1
+	int slot_cap;	// slots allocated, power of 2
+	struct spinlock slot_lock;
+	int id_mask;
+	int reuseport;
 	int event_n;
 	int event_index;
 	struct socket_object_interface soi;
 	struct event ev[MAX_EVENT];
-	struct socket slot[MAX_SOCKET];
+	struct socket *slot[MAX_SLOT_PAGE];	// pages are never freed before release, workers read them without lock
+	int read_budget;
+	int accept_n;	// accepted in current event of a listening socket
+	int accept_addr;
+	struct paused_socket *paused;
+	int paused_n;
+	int paused_cap;
 	char buffer[MAX_INFO];
-	uint8_t udpbuffer[MAX_UDP_PACKAGE];
-	fd_set rfds;
+	struct udp_batch udp;
+	uint8_t udpbuffer[UDP_BATCH][MAX_UDP_PACKAGE];
 };
 
 struct request_open {
@@ -153,6 +261,10 @@ struct request_udp {
 	uintptr_t opaque;
 };
 
+struct request_resume {
+	uintptr_t opaque;
+};
+
 /*
 	The first byte is TYPE
 
@@ -168,10 +280,11 @@ struct request_udp {
 	T Set opt
 	U Create UDP socket
 	C set udp address
+	W Enable write (the rest of direct write)
+	R Resume the sockets paused for an owner
  */
 
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy
 	union {
 		char buffer[256];
 		struct request_open open;
@@ -184,16 +297,11 @@ struct request_package {
 		struct request_setopt setopt;
 		struct request_udp udp;
 		struct request_setudp set_udp;
+		struct request_resume resume;
 	} u;
 	uint8_t dummy[256];
 };
 
-union sockaddr_all {
-	struct sockaddr s;
-	struct sockaddr_in v4;
-	struct sockaddr_in6 v6;
-};
-
 struct send_object {
 	void * buffer;
 	int sz;
@@ -203,6 +311,45 @@ struct send_object {
 #define MALLOC skynet_malloc
 #define FREE skynet_free
 
+// The lock of direct write, it can be locked again by the same owner (count).
+struct socket_lock {
+	struct spinlock *lock;
+	int count;
+};
+
+static inline void
+socket_lock_init(struct socket *s, struct socket_lock *sl) {
+	sl->lock = &s->dw_lock;
+	sl->count = 0;
+}
+
+static inline void
+socket_lock(struct socket_lock *sl) {
+	if (sl->count == 0) {
+		spinlock_lock(sl->lock);
+	}
+	++sl->count;
+}
+
+static inline int
+socket_trylock(struct socket_lock *sl) {
+	if (sl->count == 0) {
+		if (!spinlock_trylock(sl->lock))
+			return 0;	// lock failed
+	}
+	++sl->count;
+	return 1;
+}
+
+static inline void
+socket_unlock(struct socket_lock *sl) {
+	--sl->count;
+	if (sl->count <= 0) {
+		assert(sl->count == 0);
+		spinlock_unlock(sl->lock);
+	}
+}
+
 static inline bool
 send_object_init(struct socket_server *ss, struct send_object *so, void *object, int sz) {
 	if (sz < 0) {
@@ -234,33 +381,263 @@ socket_keepalive(int fd) {
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&keepalive , sizeof(keepalive));  
 }
 
+static inline void
+clear_wb_list(struct wb_list *list) {
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+/*
+	The slots are allocated in pages. The pages not allocated yet point to INVALID_PAGE,
+	so a lookup of any id is safe without lock, and it's always O(1).
+	The slot table doubles when all the slots allocated are in use, until slot_mask + 1 slots.
+ */
+
+static struct socket INVALID_PAGE[SLOT_PAGE];
+
+static inline struct socket *
+socket_slot(struct socket_server *ss, int id) {
+	unsigned h = HASH_ID(ss, id);
+	struct socket *page = __atomic_load_n(&ss->slot[h >> SLOT_PAGE_P], __ATOMIC_ACQUIRE);
+	return &page[h & (SLOT_PAGE - 1)];
+}
+
+static struct socket *
+slot_page_new(int base) {
+	struct socket *page = MALLOC(sizeof(struct socket) * SLOT_PAGE);
+	int i;
+	for (i=0;i<SLOT_PAGE;i++) {
+		struct socket *s = &page[i];
+		s->type = SOCKET_TYPE_INVALID;
+		s->id = base + i;
+		clear_wb_list(&s->high);
+		clear_wb_list(&s->low);
+		spinlock_init(&s->dw_lock);
+	}
+	return page;
+}
+
+// cap is the slot_cap seen by caller, return 0 when the slot table can't grow
+static int
+expand_slot(struct socket_server *ss, int cap) {
+	int ret = 1;
+	spinlock_lock(&ss->slot_lock);
+	int n = ss->slot_cap;
+	if (n == cap) {
+		if ((unsigned)n > ss->slot_mask) {
+			ret = 0;
+		} else {
+			int i;
+			for (i=n;i<n*2;i+=SLOT_PAGE) {
+				__atomic_store_n(&ss->slot[i >> SLOT_PAGE_P], slot_page_new(i), __ATOMIC_RELEASE);
+			}
+			__atomic_store_n(&ss->slot_cap, n*2, __ATOMIC_RELEASE);
+		}
+	}
+	spinlock_unlock(&ss->slot_lock);
+	return ret;
+}
+
 static int
 reserve_id(struct socket_server *ss) {
+	for (;;) {
+		int cap = __atomic_load_n(&ss->slot_cap, __ATOMIC_ACQUIRE);
+		int i;
+		for (i=0;i<cap;i++) {
+			unsigned h = ATOM_INC(&(ss->alloc_id)) & (cap - 1);
+			struct socket *s = &ss->slot[h >> SLOT_PAGE_P][h & (SLOT_PAGE - 1)];
+			if (s->type == SOCKET_TYPE_INVALID) {
+				if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
+					// the next generation of the slot, so the old ids of it become invalid
+					int id = (int)((s->id + ss->slot_mask + 1) & ss->id_mask);
+					s->id = id;
+					// the send requests of the old id in ctrl pipe don't count
+					s->sending = ID_TAG16(id) << 16 | 0;
+					s->fd = -1;
+					return id;
+				} else {
+					// retry
+					--i;
+				}
+			}
+		}
+		if (!expand_slot(ss, cap)) {
+			return -1;
+		}
+	}
+}
+
+/*
+	The data of SOCKET_DATA and SOCKET_UDP messages are allocated from size classed pools
+	shared by all the socket servers, the receiver should free it by socket_server_buffer_free.
+	Large buffers (more than 64K) are not cached.
+ */
+
+struct recv_buffer {
+	int cls;	// -1 : not cached
+	struct recv_buffer * next;
+};
+
+struct recv_pool {
+	struct spinlock lock;
+	int n;
+	struct recv_buffer * head;
+};
+
+static struct recv_pool RECV_POOL[RECV_CLASS];
+static int RECV_POOL_INIT = 0;
+
+static void
+recv_pool_init() {
+	if (ATOM_CAS(&RECV_POOL_INIT, 0, 1)) {
+		int i;
+		for (i=0;i<RECV_CLASS;i++) {
+			struct recv_pool *p = &RECV_POOL[i];
+			spinlock_init(&p->lock);
+			p->n = 0;
+			p->head = NULL;
+		}
+	}
+}
+
+static void
+recv_pool_clear() {
 	int i;
-	for (i=0;i<MAX_SOCKET;i++) {
-		int id = ATOM_INC(&(ss->alloc_id));
-		if (id < 0) {
-			id = ATOM_AND(&(ss->alloc_id), 0x7fffffff);
+	for (i=0;i<RECV_CLASS;i++) {
+		struct recv_pool *p = &RECV_POOL[i];
+		spinlock_lock(&p->lock);
+		struct recv_buffer *rb = p->head;
+		p->head = NULL;
+		p->n = 0;
+		spinlock_unlock(&p->lock);
+		while (rb) {
+			struct recv_buffer *tmp = rb;
+			rb = rb->next;
+			FREE(tmp);
 		}
-		struct socket *s = &ss->slot[HASH_ID(id)];
-		if (s->type == SOCKET_TYPE_INVALID) {
-			if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
-				s->id = id;
-				s->fd = -1;
-				return id;
-			} else {
-				// retry
-				--i;
+	}
+}
+
+// return the buffer, and set *cap to the capacity of it (>= sz)
+static char *
+recv_buffer_alloc(int sz, int *cap) {
+	int cls = 0;
+	while (cls < RECV_CLASS && (MIN_READ_BUFFER << cls) < sz) {
+		++cls;
+	}
+	struct recv_buffer *rb = NULL;
+	if (cls == RECV_CLASS) {
+		rb = MALLOC(sizeof(*rb) + sz);
+		rb->cls = -1;
+		*cap = sz;
+	} else {
+		struct recv_pool *p = &RECV_POOL[cls];
+		spinlock_lock(&p->lock);
+		rb = p->head;
+		if (rb) {
+			p->head = rb->next;
+			--p->n;
+		}
+		spinlock_unlock(&p->lock);
+		*cap = MIN_READ_BUFFER << cls;
+		if (rb == NULL) {
+			rb = MALLOC(sizeof(*rb) + *cap);
+			rb->cls = cls;
+		}
+	}
+	return (char *)(rb + 1);
+}
+
+void
+socket_server_buffer_free(void * buffer) {
+	if (buffer == NULL)
+		return;
+	struct recv_buffer *rb = (struct recv_buffer *)buffer - 1;
+	int cls = rb->cls;
+	if (cls >= 0) {
+		struct recv_pool *p = &RECV_POOL[cls];
+		spinlock_lock(&p->lock);
+		if (p->n < RECV_CLASS_CACHE / (MIN_READ_BUFFER << cls)) {
+			rb->next = p->head;
+			p->head = rb;
+			++p->n;
+			rb = NULL;
+		}
+		spinlock_unlock(&p->lock);
+	}
+	if (rb) {
+		FREE(rb);
+	}
+}
+
+/*
+	The ctrl commands are queued in ss->cmd, a bounded MPSC ring.
+	ss->cmd_pending counts the commands not handled yet, and the producer who
+	makes it from 0 to 1 rings the doorbell (an eventfd in the event poll),
+	so only the first command of a batch costs a syscall.
+ */
+
+static int
+doorbell_create(int fd[2]) {
+#ifdef __linux__
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return 1;
+	fd[0] = fd[1] = efd;
+#else
+	if (pipe(fd))
+		return 1;
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+#endif
+	return 0;
+}
+
+static void
+doorbell_release(int fd[2]) {
+	close(fd[0]);
+	if (fd[1] != fd[0]) {
+		close(fd[1]);
+	}
+}
+
+static void
+doorbell_ring(int fd) {
+	for (;;) {
+#ifdef __linux__
+		uint64_t v = 1;
+#else
+		uint8_t v = 1;
+#endif
+		int n = write(fd, &v, sizeof(v));
+		if (n<0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				fprintf(stderr, "socket-server : ring doorbell error %s.\n", strerror(errno));
 			}
 		}
+		return;
 	}
-	return -1;
 }
 
-static inline void
-clear_wb_list(struct wb_list *list) {
-	list->head = NULL;
-	list->tail = NULL;
+static void
+doorbell_reset(int fd) {
+	uint64_t v[16];
+	for (;;) {
+		int n = read(fd, v, sizeof(v));
+		if (n<0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+#ifdef __linux__
+		return;
+#else
+		if (n < sizeof(v))
+			return;
+#endif
+	}
 }
 
 struct socket_server * 
@@ -272,38 +649,56 @@ socket_server_create() {
 		fprintf(stderr, "socket-server: create event pool failed.\n");
 		return NULL;
 	}
-	if (pipe(fd)) {
+	if (doorbell_create(fd)) {
 		sp_release(efd);
-		fprintf(stderr, "socket-server: create socket pair failed.\n");
+		fprintf(stderr, "socket-server: create doorbell failed.\n");
 		return NULL;
 	}
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
-		close(fd[0]);
-		close(fd[1]);
+		doorbell_release(fd);
 		sp_release(efd);
 		return NULL;
 	}
 
+	recv_pool_init();
+
 	struct socket_server *ss = MALLOC(sizeof(*ss));
 	ss->event_fd = efd;
 	ss->recvctrl_fd = fd[0];
 	ss->sendctrl_fd = fd[1];
 	ss->checkctrl = 1;
+	ss->cmd_batch = MAX_CMD_BATCH;
+	ss->cmd_head = 0;
+	ss->cmd_tail = 0;
+	ss->cmd_pending = 0;
+	for (i=0;i<CMD_RING_SIZE;i++) {
+		ss->cmd[i].seq = i;
+	}
 
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
-		s->type = SOCKET_TYPE_INVALID;
-		clear_wb_list(&s->high);
-		clear_wb_list(&s->low);
+	ss->slot[0] = slot_page_new(0);
+	for (i=1;i<MAX_SLOT_PAGE;i++) {
+		ss->slot[i] = INVALID_PAGE;
 	}
+	ss->slot_cap = SLOT_PAGE;
+	ss->slot_mask = (1 << MIN_SOCKET_P) - 1;
+	spinlock_init(&ss->slot_lock);
 	ss->alloc_id = 0;
+	ss->id_mask = 0x7fffffff;
+	ss->reuseport = 0;
+	ss->read_budget = 0;
+	ss->accept_n = 0;
+	ss->accept_addr = 1;
+	ss->paused = NULL;
+	ss->paused_n = 0;
+	ss->paused_cap = 0;
+	ss->udp.s = NULL;
+	ss->udp.n = 0;
+	ss->udp.index = 0;
 	ss->event_n = 0;
 	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
@@ -321,7 +716,14 @@ free_wb_list(struct socket_server *ss, struct wb_list *list) {
 }
 
 static void
-force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+free_buffer(struct socket_server *ss, const void * buffer, int sz) {
+	struct send_object so;
+	send_object_init(ss, &so, (void *)buffer, sz);
+	so.free_func((void *)buffer);
+}
+
+static void
+force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	result->id = s->id;
 	result->ud = 0;
 	result->data = NULL;
@@ -330,8 +732,19 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 		return;
 	}
 	assert(s->type != SOCKET_TYPE_RESERVE);
+	// lock it, so no worker writes to the fd after close
+	socket_lock(l);
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
+	if (s->dw_buffer) {
+		free_buffer(ss, s->dw_buffer, s->dw_size);
+		s->dw_buffer = NULL;
+	}
+	if (ss->udp.s == s) {
+		// drop the udp packages not reported
+		ss->udp.s = NULL;
+		ss->udp.n = 0;
+	}
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
 		sp_del(ss->event_fd, s->fd);
 	}
@@ -339,22 +752,31 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 		close(s->fd);
 	}
 	s->type = SOCKET_TYPE_INVALID;
+	socket_unlock(l);
 }
 
 void 
 socket_server_release(struct socket_server *ss) {
 	int i;
 	struct socket_message dummy;
-	for (i=0;i<MAX_SOCKET;i++) {
-		struct socket *s = &ss->slot[i];
+	for (i=0;i<ss->slot_cap;i++) {
+		struct socket *s = &ss->slot[i >> SLOT_PAGE_P][i & (SLOT_PAGE - 1)];
+		struct socket_lock l;
+		socket_lock_init(s, &l);
 		if (s->type != SOCKET_TYPE_RESERVE) {
-			force_close(ss, s , &dummy);
+			force_close(ss, s, &l, &dummy);
 		}
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
+	for (i=0;i<ss->slot_cap;i+=SLOT_PAGE) {
+		FREE(ss->slot[i >> SLOT_PAGE_P]);
+	}
+	spinlock_destroy(&ss->slot_lock);
+	FREE(ss->paused);
+	int fd[2] = { ss->recvctrl_fd, ss->sendctrl_fd };
+	doorbell_release(fd);
 	sp_release(ss->event_fd);
 	FREE(ss);
+	recv_pool_clear();
 }
 
 static inline void
@@ -363,9 +785,26 @@ check_wb_list(struct wb_list *s) {
 	assert(s->tail == NULL);
 }
 
+// Only the socket thread changes the events of the fds, so s->reading/writing are the events in the poll.
+static inline void
+enable_write(struct socket_server *ss, struct socket *s, bool enable) {
+	if (s->writing != enable) {
+		s->writing = enable;
+		sp_enable(ss->event_fd, s->fd, s, s->reading, enable);
+	}
+}
+
+static inline void
+enable_read(struct socket_server *ss, struct socket *s, bool enable) {
+	if (s->reading != enable) {
+		s->reading = enable;
+		sp_enable(ss->event_fd, s->fd, s, enable, s->writing);
+	}
+}
+
 static struct socket *
 new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque, bool add) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	assert(s->type == SOCKET_TYPE_RESERVE);
 
 	if (add) {
@@ -378,9 +817,13 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->id = id;
 	s->fd = fd;
 	s->protocol = protocol;
+	s->reading = true;
+	s->writing = false;
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	s->wb_size = 0;
+	s->dw_buffer = NULL;
+	s->dw_size = 0;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	return s;
@@ -451,23 +894,33 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		return SOCKET_OPEN;
 	} else {
 		ns->type = SOCKET_TYPE_CONNECTING;
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		enable_write(ss, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
 	return -1;
 _failed:
 	freeaddrinfo( ai_list );
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	socket_slot(ss, id)->type = SOCKET_TYPE_INVALID;
 	return SOCKET_ERROR;
 }
 
 static int
-send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	struct iovec iov[MAX_IOV];
 	while (list->head) {
+		// gather the head of list (at most MAX_IOV buffers), and send them in one writev
 		struct write_buffer * tmp = list->head;
+		int n = 0;
+		while (tmp && n < MAX_IOV) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+			tmp = tmp->next;
+		}
+		ssize_t sz;
 		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, iov, n);
 			if (sz < 0) {
 				switch(errno) {
 				case EINTR:
@@ -475,19 +928,25 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				case EAGAIN:
 					return -1;
 				}
-				force_close(ss,s, result);
+				force_close(ss,s,l,result);
 				return SOCKET_CLOSE;
 			}
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
+			break;
+		}
+		s->wb_size -= sz;
+		int i;
+		for (i=0;i<n;i++) {
+			tmp = list->head;
+			if (sz < tmp->sz) {
+				// send a part, the kernel buffer is full
 				tmp->ptr += sz;
 				tmp->sz -= sz;
 				return -1;
 			}
-			break;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
 
@@ -518,13 +977,56 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	return 0;
 }
 
+#if UDP_BATCH > 1
+
+// send the head of list (at most UDP_BATCH packages) in one sendmmsg, return how many are sent
+static int
+send_udp_batch(struct socket *s, struct wb_list *list) {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all sa[UDP_BATCH];
+	struct write_buffer * tmp = list->head;
+	int n = 0;
+	while (tmp && n < UDP_BATCH) {
+		iov[n].iov_base = tmp->ptr;
+		iov[n].iov_len = tmp->sz;
+		memset(&msg[n].msg_hdr, 0, sizeof(msg[n].msg_hdr));
+		msg[n].msg_hdr.msg_name = &sa[n];
+		msg[n].msg_hdr.msg_namelen = udp_socket_address(s, tmp->udp_address, &sa[n]);
+		msg[n].msg_hdr.msg_iov = &iov[n];
+		msg[n].msg_hdr.msg_iovlen = 1;
+		++n;
+		tmp = tmp->next;
+	}
+	return sendmmsg(s->fd, msg, n, 0);
+}
+
+#endif
+
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
 	while (list->head) {
+#if UDP_BATCH > 1
+		int n = send_udp_batch(s, list);
+		if (n == 0) {
+			return -1;
+		}
+		if (n > 0) {
+			while (n-- > 0) {
+				struct write_buffer * tmp = list->head;
+				s->wb_size -= tmp->sz;
+				list->head = tmp->next;
+				write_buffer_free(ss,tmp);
+			}
+			continue;
+		}
+		int err = n;
+#else
 		struct write_buffer * tmp = list->head;
 		union sockaddr_all sa;
 		socklen_t sasz = udp_socket_address(s, tmp->udp_address, &sa);
 		int err = sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa.s, sasz);
+#endif
 		if (err < 0) {
 			switch(errno) {
 			case EINTR:
@@ -543,10 +1045,11 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 			return SOCKET_ERROR;
 */
 		}
-
+#if UDP_BATCH == 1
 		s->wb_size -= tmp->sz;
 		list->head = tmp->next;
 		write_buffer_free(ss,tmp);
+#endif
 	}
 	list->tail = NULL;
 
@@ -554,9 +1057,9 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 }
 
 static int
-send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
 	if (s->protocol == PROTOCOL_TCP) {
-		return send_list_tcp(ss, s, list, result);
+		return send_list_tcp(ss, s, list, l, result);
 	} else {
 		return send_list_udp(ss, s, list, result);
 	}
@@ -597,16 +1100,16 @@ raise_uncomplete(struct socket * s) {
 	4. If two lists are both empty, turn off the event. (call check_close)
  */
 static int
-send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	assert(!list_uncomplete(&s->low));
 	// step 1
-	if (send_list(ss,s,&s->high,result) == SOCKET_CLOSE) {
+	if (send_list(ss,s,&s->high,l,result) == SOCKET_CLOSE) {
 		return SOCKET_CLOSE;
 	}
 	if (s->high.head == NULL) {
 		// step 2
 		if (s->low.head != NULL) {
-			if (send_list(ss,s,&s->low,result) == SOCKET_CLOSE) {
+			if (send_list(ss,s,&s->low,l,result) == SOCKET_CLOSE) {
 				return SOCKET_CLOSE;
 			}
 			// step 3
@@ -615,10 +1118,10 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *r
 			}
 		} else {
 			// step 4
-			sp_write(ss->event_fd, s->fd, s, false);
+			enable_write(ss, s, false);
 
 			if (s->type == SOCKET_TYPE_HALFCLOSE) {
-				force_close(ss, s, result);
+				force_close(ss, s, l, result);
 				return SOCKET_CLOSE;
 			}
 		}
@@ -627,6 +1130,37 @@ send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *r
 	return -1;
 }
 
+// the rest of the direct write goes before the high list, call it with lock
+static void
+raise_direct_write(struct socket_server *ss, struct socket *s) {
+	// the whole struct (not SIZEOF_TCPBUFFER), it's rare and the compiler can see the size here
+	struct write_buffer * buf = MALLOC(sizeof(*buf));
+	struct send_object so;
+	buf->userobject = send_object_init(ss, &so, (void *)s->dw_buffer, s->dw_size);
+	buf->ptr = (char*)so.buffer+s->dw_offset;
+	buf->sz = so.sz - s->dw_offset;
+	buf->buffer = (void *)s->dw_buffer;
+	s->wb_size += buf->sz;
+	buf->next = s->high.head;
+	s->high.head = buf;
+	if (s->high.tail == NULL) {
+		s->high.tail = buf;
+	}
+	s->dw_buffer = NULL;
+}
+
+static int
+send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
+	if (!socket_trylock(l))
+		return -1;	// blocked by direct write, send later (the write event is still on).
+	if (s->dw_buffer) {
+		raise_direct_write(ss, s);
+	}
+	int r = send_buffer_(ss, s, l, result);
+	socket_unlock(l);
+	return r;
+}
+
 static struct write_buffer *
 append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_send * request, int size, int n) {
 	struct write_buffer * buf = MALLOC(size);
@@ -669,7 +1203,48 @@ append_sendbuffer_low(struct socket_server *ss,struct socket *s, struct request_
 
 static inline int
 send_buffer_empty(struct socket *s) {
-	return (s->high.head == NULL && s->low.head == NULL);
+	return (s->high.head == NULL && s->low.head == NULL && s->dw_buffer == NULL);
+}
+
+// A worker can write to the fd directly only when nothing is waiting to be sent,
+// so the order of packages is kept. Call it with lock.
+static inline int
+can_direct_write(struct socket *s, int id) {
+	return s->id == id
+		&& s->type == SOCKET_TYPE_CONNECTED
+		&& s->protocol == PROTOCOL_TCP
+		&& send_buffer_empty(s)
+		&& (__atomic_load_n(&s->sending, __ATOMIC_ACQUIRE) & 0xffff) == 0;
+}
+
+static inline void
+inc_sending_ref(struct socket *s, int id) {
+	for (;;) {
+		uint32_t sending = __atomic_load_n(&s->sending, __ATOMIC_ACQUIRE);
+		if ((sending >> 16) != ID_TAG16(id)) {
+			// socket id changed, the request will be dropped
+			return;
+		}
+		if ((sending & 0xffff) == 0xffff) {
+			// too many requests in the pipe (rarely), wait for the socket thread
+			continue;
+		}
+		if (ATOM_CAS(&s->sending, sending, sending + 1))
+			return;
+	}
+}
+
+static inline void
+dec_sending_ref(struct socket_server *ss, int id) {
+	struct socket * s = socket_slot(ss, id);
+	for (;;) {
+		uint32_t sending = __atomic_load_n(&s->sending, __ATOMIC_ACQUIRE);
+		if ((sending >> 16) != ID_TAG16(id) || (sending & 0xffff) == 0) {
+			return;
+		}
+		if (ATOM_CAS(&s->sending, sending, sending - 1))
+			return;
+	}
 }
 
 /*
@@ -682,7 +1257,7 @@ send_buffer_empty(struct socket *s) {
 static int
 send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	struct send_object so;
 	send_object_init(ss, &so, request->buffer, request->sz);
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id 
@@ -696,6 +1271,17 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		so.free_func(request->buffer);
 		return -1;
 	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	if (s->protocol == PROTOCOL_TCP) {
+		// the worker may write directly after the request is counted out (see dec_sending_ref),
+		// and the rest of direct write (dw_buffer) is set with lock.
+		socket_lock(&l);
+		if (s->dw_buffer) {
+			raise_direct_write(ss, s);
+			enable_write(ss, s, true);
+		}
+	}
 	if (send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED) {
 		if (s->protocol == PROTOCOL_TCP) {
 			int n = write(s->fd, so.buffer, so.sz);
@@ -707,12 +1293,14 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 					break;
 				default:
 					fprintf(stderr, "socket-server: write to %d (fd=%d) error :%s.\n",id,s->fd,strerror(errno));
-					force_close(ss,s,result);
+					force_close(ss,s,&l,result);
+					socket_unlock(&l);
 					so.free_func(request->buffer);
 					return SOCKET_CLOSE;
 				}
 			}
 			if (n == so.sz) {
+				socket_unlock(&l);
 				so.free_func(request->buffer);
 				return -1;
 			}
@@ -732,7 +1320,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				return -1;
 			}
 		}
-		sp_write(ss->event_fd, s->fd, s, true);
+		enable_write(ss, s, true);
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
@@ -747,6 +1335,9 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 			append_sendbuffer_udp(ss,s,priority,request,udp_address);
 		}
 	}
+	if (s->protocol == PROTOCOL_TCP) {
+		socket_unlock(&l);
+	}
 	return -1;
 }
 
@@ -759,6 +1350,7 @@ listen_socket(struct socket_server *ss, struct request_listen * request, struct
 		goto _failed;
 	}
 	s->type = SOCKET_TYPE_PLISTEN;
+	memset(&s->p.listen, 0, sizeof(s->p.listen));
 	return -1;
 _failed:
 	close(listen_fd);
@@ -766,7 +1358,7 @@ _failed:
 	result->id = id;
 	result->ud = 0;
 	result->data = "reach skynet socket number limit";
-	ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+	socket_slot(ss, id)->type = SOCKET_TYPE_INVALID;
 
 	return SOCKET_ERROR;
 }
@@ -774,7 +1366,7 @@ _failed:
 static int
 close_socket(struct socket_server *ss, struct request_close *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
 		result->id = id;
 		result->opaque = request->opaque;
@@ -782,13 +1374,15 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 		result->data = NULL;
 		return SOCKET_CLOSE;
 	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
 	if (!send_buffer_empty(s)) { 
-		int type = send_buffer(ss,s,result);
+		int type = send_buffer(ss,s,&l,result);
 		if (type != -1)
 			return type;
 	}
 	if (send_buffer_empty(s)) {
-		force_close(ss,s,result);
+		force_close(ss,s,&l,result);
 		result->id = id;
 		result->opaque = request->opaque;
 		return SOCKET_CLOSE;
@@ -822,7 +1416,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	result->opaque = request->opaque;
 	result->ud = 0;
 	result->data = NULL;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		result->data = "invalid socket";
 		return SOCKET_ERROR;
@@ -839,6 +1433,10 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 		return SOCKET_OPEN;
 	} else if (s->type == SOCKET_TYPE_CONNECTED) {
 		s->opaque = request->opaque;
+		if (!s->reading) {
+			// paused for the old owner
+			enable_read(ss, s, true);
+		}
 		result->data = "transfer";
 		return SOCKET_OPEN;
 	}
@@ -848,7 +1446,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 static void
 setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return;
 	}
@@ -856,34 +1454,60 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
+// a worker wrote a part directly, send the rest when the fd is writable
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			if (errno == EINTR)
+enable_direct_write(struct socket_server *ss, int id) {
+	struct socket *s = socket_slot(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id) {
+		return;
+	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	if (s->dw_buffer) {
+		raise_direct_write(ss, s);
+		enable_write(ss, s, true);
+	}
+	socket_unlock(&l);
+}
+
+static void
+resume_socket(struct socket_server *ss, uintptr_t opaque) {
+	int i = 0;
+	while (i < ss->paused_n) {
+		struct paused_socket *p = &ss->paused[i];
+		if (p->opaque != opaque) {
+			struct socket *s = socket_slot(ss, p->id);
+			if (s->id == p->id && s->type != SOCKET_TYPE_INVALID && !s->reading) {
+				++i;
 				continue;
-			fprintf(stderr, "socket-server : read pipe error %s.\n",strerror(errno));
-			return;
+			}
+			// closed or resumed, remove it
+		} else {
+			struct socket *s = socket_slot(ss, p->id);
+			if (s->id == p->id && s->type != SOCKET_TYPE_INVALID) {
+				enable_read(ss, s, true);
+			}
 		}
-		// must atomic read from a pipe
-		assert(n == sz);
-		return;
+		*p = ss->paused[--ss->paused_n];
 	}
 }
 
 static int
 has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
-
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
+	struct cmd_slot *slot = &ss->cmd[ss->cmd_head % CMD_RING_SIZE];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ss->cmd_head + 1) {
 		return 1;
 	}
-	return 0;
+	if (__atomic_load_n(&ss->cmd_pending, __ATOMIC_ACQUIRE) <= 0) {
+		return 0;
+	}
+	// A command is counted but the head slot is not published yet, the producer
+	// is copying it. We can't wait for the doorbell, because it may be rung already.
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ss->cmd_head + 1) {
+		sched_yield();
+	}
+	return 1;
 }
 
 static void
@@ -898,7 +1522,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 	struct socket *ns = new_fd(ss, id, udp->fd, protocol, udp->opaque, true);
 	if (ns == NULL) {
 		close(udp->fd);
-		ss->slot[HASH_ID(id)].type = SOCKET_TYPE_INVALID;
+		socket_slot(ss, id)->type = SOCKET_TYPE_INVALID;
 		return;
 	}
 	ns->type = SOCKET_TYPE_CONNECTED;
@@ -908,7 +1532,7 @@ add_udp_socket(struct socket_server *ss, struct request_udp *udp) {
 static int
 set_udp_address(struct socket_server *ss, struct request_setudp *request, struct socket_message *result) {
 	int id = request->id;
-	struct socket *s = &ss->slot[HASH_ID(id)];
+	struct socket *s = socket_slot(ss, id);
 	if (s->type == SOCKET_TYPE_INVALID || s->id !=id) {
 		return -1;
 	}
@@ -933,14 +1557,16 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 // return type
 static int
 ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
+	// the length of message is one byte, so 256 buffer size is enough.
 	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
+	struct cmd_slot *slot = &ss->cmd[ss->cmd_head % CMD_RING_SIZE];
+	int type = slot->type;
+	int len = slot->len;
+	memcpy(buffer, slot->buffer, len);
+	// release the slot to producers
+	__atomic_store_n(&slot->seq, ss->cmd_head + CMD_RING_SIZE, __ATOMIC_RELEASE);
+	++ss->cmd_head;
+	ATOM_DEC(&ss->cmd_pending);
 	// ctrl command only exist in local fd, so don't worry about endian.
 	switch (type) {
 	case 'S':
@@ -960,9 +1586,14 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		result->data = NULL;
 		return SOCKET_EXIT;
 	case 'D':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_HIGH, NULL);
-	case 'P':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_LOW, NULL);
+	case 'P': {
+		int priority = (type == 'D') ? PRIORITY_HIGH : PRIORITY_LOW;
+		struct request_send * request = (struct request_send *)buffer;
+		int ret = send_socket(ss, request, result, priority, NULL);
+		// count out after the package is written or appended to the list
+		dec_sending_ref(ss, request->id);
+		return ret;
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -975,6 +1606,12 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'W':
+		enable_direct_write(ss, ((struct request_send *)buffer)->id);
+		return -1;
+	case 'R':
+		resume_socket(ss, ((struct request_resume *)buffer)->opaque);
+		return -1;
 	default:
 		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
 		return -1;
@@ -983,14 +1620,41 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+// Keep reading a full buffer until EAGAIN or ss->read_budget bytes, so the data of one wakeup is in one message.
+// Errors (and EOF) are reported at next poll, because the fd is still readable.
+static int
+read_more(struct socket_server *ss, struct socket *s, char ** pbuffer, int n) {
+	char * buffer = *pbuffer;
+	int limit = n;
+	while (n == limit && limit < ss->read_budget) {
+		limit *= 2;
+		if (limit > ss->read_budget) {
+			limit = ss->read_budget;
+		}
+		int cap;
+		char * tmp = recv_buffer_alloc(limit, &cap);
+		memcpy(tmp, buffer, n);
+		socket_server_buffer_free(buffer);
+		buffer = tmp;
+		int r = (int)read(s->fd, buffer + n, limit - n);
+		if (r <= 0) {
+			break;
+		}
+		n += r;
+	}
+	*pbuffer = buffer;
+	return n;
+}
+
 // return -1 (ignore) when error
 static int
-forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
+	int cap;
+	char * buffer = recv_buffer_alloc(sz, &cap);
 	int n = (int)read(s->fd, buffer, sz);
 	if (n<0) {
-		FREE(buffer);
+		socket_server_buffer_free(buffer);
 		switch(errno) {
 		case EINTR:
 			break;
@@ -999,25 +1663,29 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_me
 			break;
 		default:
 			// close when error
-			force_close(ss, s, result);
+			force_close(ss, s, l, result);
 			result->data = strerror(errno);
 			return SOCKET_ERROR;
 		}
 		return -1;
 	}
 	if (n==0) {
-		FREE(buffer);
-		force_close(ss, s, result);
+		socket_server_buffer_free(buffer);
+		force_close(ss, s, l, result);
 		return SOCKET_CLOSE;
 	}
 
 	if (s->type == SOCKET_TYPE_HALFCLOSE) {
 		// discard recv data
-		FREE(buffer);
+		socket_server_buffer_free(buffer);
 		return -1;
 	}
 
-	if (n == sz) {
+	if (n == sz && ss->read_budget > sz) {
+		n = read_more(ss, s, &buffer, n);
+	}
+
+	if (n >= sz) {
 		s->p.size *= 2;
 	} else if (sz > MIN_READ_BUFFER && n*2 < sz) {
 		s->p.size /= 2;
@@ -1048,53 +1716,104 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+// read udp packages of s into ss->udp, return the number of packages
 static int
-forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
-	union sockaddr_all sa;
-	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
-	if (n<0) {
-		switch(errno) {
-		case EINTR:
-		case EAGAIN:
-			break;
-		default:
-			// close when error
-			force_close(ss, s, result);
-			result->data = strerror(errno);
-			return SOCKET_ERROR;
-		}
-		return -1;
-	}
-	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
-		if (s->protocol != PROTOCOL_UDP)
+read_udp_batch(struct socket_server *ss, struct socket *s) {
+	struct udp_batch *b = &ss->udp;
+	int i;
+#if UDP_BATCH > 1
+	for (i=0;i<UDP_BATCH;i++) {
+		b->iov[i].iov_base = ss->udpbuffer[i];
+		b->iov[i].iov_len = MAX_UDP_PACKAGE;
+		memset(&b->msg[i].msg_hdr, 0, sizeof(b->msg[i].msg_hdr));
+		b->msg[i].msg_hdr.msg_name = &b->addr[i];
+		b->msg[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	int n = recvmmsg(s->fd, b->msg, UDP_BATCH, 0, NULL);
+	for (i=0;i<n;i++) {
+		b->sz[i] = b->msg[i].msg_len;
+		b->slen[i] = b->msg[i].msg_hdr.msg_namelen;
+	}
+#else
+	i = 0;
+	b->slen[0] = sizeof(b->addr[0]);
+	int n = recvfrom(s->fd, ss->udpbuffer[0], MAX_UDP_PACKAGE, 0, &b->addr[0].s, &b->slen[0]);
+	if (n >= 0) {
+		b->sz[0] = n;
+		n = 1;
+	}
+#endif
+	if (n > 0) {
+		b->s = s;
+		b->n = n;
+		b->index = 0;
+	}
+	return n;
+}
+
+static int
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct udp_batch *b = &ss->udp;
+	if (b->s != s || b->index >= b->n) {
+		b->s = NULL;
+		b->n = 0;
+		if (!s->reading) {
+			// paused by socket_server_pause : the packages read are all reported, don't read more
 			return -1;
-		data = MALLOC(n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (s->protocol != PROTOCOL_UDPv6)
+		}
+		if (read_udp_batch(ss, s) < 0) {
+			switch(errno) {
+			case EINTR:
+			case EAGAIN:
+				break;
+			default:
+				// close when error
+				force_close(ss, s, l, result);
+				result->data = strerror(errno);
+				return SOCKET_ERROR;
+			}
 			return -1;
-		data = MALLOC(n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
+		}
 	}
-	memcpy(data, ss->udpbuffer, n);
+	while (b->index < b->n) {
+		int i = b->index++;
+		int n = b->sz[i];
+		socklen_t slen = b->slen[i];
+		union sockaddr_all *sa = &b->addr[i];
+		uint8_t * data;
+		int cap;
+		if (slen == sizeof(sa->v4)) {
+			if (s->protocol != PROTOCOL_UDP)
+				continue;	// skip this package only, the rest of the batch is still reported
+			data = (uint8_t *)recv_buffer_alloc(n + 1 + 2 + 4, &cap);
+			gen_udp_address(PROTOCOL_UDP, sa, data + n);
+		} else {
+			if (s->protocol != PROTOCOL_UDPv6)
+				continue;
+			data = (uint8_t *)recv_buffer_alloc(n + 1 + 2 + 16, &cap);
+			gen_udp_address(PROTOCOL_UDPv6, sa, data + n);
+		}
+		memcpy(data, ss->udpbuffer[i], n);
 
-	result->opaque = s->opaque;
-	result->id = s->id;
-	result->ud = n;
-	result->data = (char *)data;
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = n;
+		result->data = (char *)data;
 
-	return SOCKET_UDP;
+		return SOCKET_UDP;
+	}
+	return -1;
 }
 
 static int
-report_connect(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	int error;
 	socklen_t len = sizeof(error);  
 	int code = getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len);  
 	if (code < 0 || error) {  
-		force_close(ss,s, result);
+		force_close(ss,s,l, result);
 		if (code >= 0)
 			result->data = strerror(error);
 		else
@@ -1106,7 +1825,7 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 		result->id = s->id;
 		result->ud = 0;
 		if (send_buffer_empty(s)) {
-			sp_write(ss->event_fd, s->fd, s, false);
+			enable_write(ss, s, false);
 		}
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
@@ -1122,14 +1841,72 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 	}
 }
 
-// return 0 when failed, or -1 when file limit
+static char *
+format_uint(char *p, unsigned v) {
+	char tmp[10];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n > 0) {
+		*p++ = tmp[--n];
+	}
+	return p;
+}
+
+// "ip:port" without snprintf, buffer should be larger than INET6_ADDRSTRLEN + 6
+static const char *
+format_address(char *buffer, const union sockaddr_all *u) {
+	char *p = buffer;
+	int port;
+	if (u->s.sa_family == AF_INET) {
+		const uint8_t *ip = (const uint8_t *)&u->v4.sin_addr;
+		int i;
+		for (i=0;i<4;i++) {
+			p = format_uint(p, ip[i]);
+			*p++ = (i < 3) ? '.' : ':';
+		}
+		port = ntohs(u->v4.sin_port);
+	} else {
+		if (inet_ntop(u->s.sa_family, &u->v6.sin6_addr, buffer, INET6_ADDRSTRLEN) == NULL) {
+			return NULL;
+		}
+		p = buffer + strlen(buffer);
+		*p++ = ':';
+		port = ntohs(u->v6.sin6_port);
+	}
+	p = format_uint(p, port);
+	*p = '\0';
+	return buffer;
+}
+
+static void
+count_accept(struct socket *s) {
+	uint32_t now = (uint32_t)time(NULL);
+	++s->p.listen.accepted;
+	if (now != s->p.listen.second) {
+		s->p.listen.last_n = (now == s->p.listen.second + 1) ? s->p.listen.second_n : 0;
+		s->p.listen.second = now;
+		s->p.listen.second_n = 0;
+	}
+	++s->p.listen.second_n;
+}
+
+// return 0 when there is nothing to accept (or the connection is dropped), or -1 when file limit
 static int
 report_accept(struct socket_server *ss, struct socket *s, struct socket_message *result) {
 	union sockaddr_all u;
 	socklen_t len = sizeof(u);
+#ifdef __linux__
+	// the accepted socket inherits SO_KEEPALIVE from the listening socket (see do_listen)
+	int client_fd = accept4(s->fd, &u.s, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	int client_fd = accept(s->fd, &u.s, &len);
+#endif
 	if (client_fd < 0) {
 		if (errno == EMFILE || errno == ENFILE) {
+			++s->p.listen.dropped;
 			result->opaque = s->opaque;
 			result->id = s->id;
 			result->ud = 0;
@@ -1141,28 +1918,29 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	}
 	int id = reserve_id(ss);
 	if (id < 0) {
+		++s->p.listen.dropped;
 		close(client_fd);
 		return 0;
 	}
+#ifndef __linux__
 	socket_keepalive(client_fd);
 	sp_nonblocking(client_fd);
+#endif
 	struct socket *ns = new_fd(ss, id, client_fd, PROTOCOL_TCP, s->opaque, false);
 	if (ns == NULL) {
+		++s->p.listen.dropped;
 		close(client_fd);
 		return 0;
 	}
 	ns->type = SOCKET_TYPE_PACCEPT;
+	count_accept(s);
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = id;
 	result->data = NULL;
 
-	void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-	int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
-	char tmp[INET6_ADDRSTRLEN];
-	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
-		snprintf(ss->buffer, sizeof(ss->buffer), "%s:%d", tmp, sin_port);
-		result->data = ss->buffer;
+	if (ss->accept_addr) {
+		result->data = (char *)format_address(ss->buffer, &u);
 	}
 
 	return 1;
@@ -1191,7 +1969,8 @@ int
 socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
 	for (;;) {
 		if (ss->checkctrl) {
-			if (has_cmd(ss)) {
+			if (ss->cmd_batch > 0 && has_cmd(ss)) {
+				--ss->cmd_batch;
 				int type = ctrl_cmd(ss, result);
 				if (type != -1) {
 					clear_closed_event(ss, result, type);
@@ -1203,13 +1982,19 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			}
 		}
 		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
+			// don't block when some commands are left (out of cmd_batch)
+			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT, has_cmd(ss) ? 0 : -1);
 			ss->checkctrl = 1;
+			ss->cmd_batch = MAX_CMD_BATCH;
 			if (more) {
 				*more = 0;
 			}
 			ss->event_index = 0;
 			if (ss->event_n <= 0) {
+				if (ss->event_n == 0) {
+					// no event yet, go on with the commands
+					continue;
+				}
 				ss->event_n = 0;
 				return -1;
 			}
@@ -1217,17 +2002,29 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 		struct event *e = &ss->ev[ss->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// doorbell rings, reset it and check the command ring again
+			doorbell_reset(ss->recvctrl_fd);
+			ss->checkctrl = 1;
 			continue;
 		}
+		struct socket_lock l;
+		socket_lock_init(s, &l);
 		switch (s->type) {
 		case SOCKET_TYPE_CONNECTING:
-			return report_connect(ss, s, result);
+			return report_connect(ss, s, &l, result);
 		case SOCKET_TYPE_LISTEN: {
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
+				// drain the backlog : accept again in next poll, until EAGAIN or MAX_ACCEPT_BATCH
+				if (++ss->accept_n < MAX_ACCEPT_BATCH) {
+					--ss->event_index;
+				} else {
+					ss->accept_n = 0;
+				}
 				return SOCKET_ACCEPT;
-			} if (ok < 0 ) {
+			}
+			ss->accept_n = 0;
+			if (ok < 0 ) {
 				return SOCKET_ERROR;
 			}
 			// when ok == 0, retry
@@ -1240,11 +2037,12 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			if (e->read) {
 				int type;
 				if (s->protocol == PROTOCOL_TCP) {
-					type = forward_message_tcp(ss, s, result);
+					type = forward_message_tcp(ss, s, &l, result);
 				} else {
-					type = forward_message_udp(ss, s, result);
+					type = forward_message_udp(ss, s, &l, result);
 					if (type == SOCKET_UDP) {
-						// try read again
+						// try read again : report the rest of the batch, and read the next batch
+						// only if it's not paused (see forward_message_udp) after this package
 						--ss->event_index;
 						return SOCKET_UDP;
 					}
@@ -1259,7 +2057,7 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				return type;
 			}
 			if (e->write) {
-				int type = send_buffer(ss, s, result);
+				int type = send_buffer(ss, s, &l, result);
 				if (type == -1)
 					break;
 				return type;
@@ -1271,18 +2069,27 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 
 static void
 send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
+	uint32_t pos;
+	struct cmd_slot *slot;
 	for (;;) {
-		int n = write(ss->sendctrl_fd, &request->header[6], len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
-			}
-			continue;
+		pos = __atomic_load_n(&ss->cmd_tail, __ATOMIC_RELAXED);
+		slot = &ss->cmd[pos % CMD_RING_SIZE];
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {
+			if (ATOM_CAS(&ss->cmd_tail, pos, pos+1))
+				break;
+		} else if (diff < 0) {
+			// the ring is full, wait for socket thread
+			sched_yield();
 		}
-		assert(n == len+2);
-		return;
+	}
+	slot->type = (uint8_t)type;
+	slot->len = (uint8_t)len;
+	memcpy(slot->buffer, &request->u, len);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	if (ATOM_FINC(&ss->cmd_pending) == 0) {
+		doorbell_ring(ss->sendctrl_fd);
 	}
 }
 
@@ -1315,22 +2122,54 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 	return request.u.open.id;
 }
 
-static void
-free_buffer(struct socket_server *ss, const void * buffer, int sz) {
-	struct send_object so;
-	send_object_init(ss, &so, (void *)buffer, sz);
-	so.free_func((void *)buffer);
-}
-
 // return -1 when error
 int64_t 
 socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return -1;
 	}
 
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+
+	// Direct write: when nothing is waiting to be sent, write it in the calling thread
+	// instead of sending a request to the socket thread through the ctrl pipe.
+	if (can_direct_write(s,id) && socket_trylock(&l)) {
+		// check again with lock
+		if (can_direct_write(s,id)) {
+			struct send_object so;
+			send_object_init(ss, &so, (void *)buffer, sz);
+			ssize_t n = write(s->fd, so.buffer, so.sz);
+			if (n<0) {
+				// ignore error, let the socket thread try again
+				n = 0;
+			}
+			if (n == so.sz) {
+				// write done
+				socket_unlock(&l);
+				so.free_func((void *)buffer);
+				return 0;
+			}
+			// write a part, put the rest in s->dw_*, and let the socket thread send it. see send_buffer()
+			s->dw_buffer = buffer;
+			s->dw_size = sz;
+			s->dw_offset = n;
+
+			socket_unlock(&l);
+
+			// only the socket thread changes the events of the fd
+			struct request_package request;
+			request.u.send.id = id;
+			send_request(ss, &request, 'W', sizeof(request.u.send.id));
+			return 0;
+		}
+		socket_unlock(&l);
+	}
+
+	inc_sending_ref(s, id);
+
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.sz = sz;
@@ -1342,12 +2181,14 @@ socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz
 
 void 
 socket_server_send_lowpriority(struct socket_server *ss, int id, const void * buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return;
 	}
 
+	inc_sending_ref(s, id);
+
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.sz = sz;
@@ -1373,7 +2214,7 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 // return -1 means failed
 // or return AF_INET or AF_INET6
 static int
-do_bind(const char *host, int port, int protocol, int *family) {
+do_bind(const char *host, int port, int protocol, int *family, int reuseport) {
 	int fd;
 	int status;
 	int reuse = 1;
@@ -1406,6 +2247,11 @@ do_bind(const char *host, int port, int protocol, int *family) {
 	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int))==-1) {
 		goto _failed;
 	}
+#ifdef SO_REUSEPORT
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int))==-1) {
+		goto _failed;
+	}
+#endif
 	status = bind(fd, (struct sockaddr *)ai_list->ai_addr, ai_list->ai_addrlen);
 	if (status != 0)
 		goto _failed;
@@ -1420,9 +2266,9 @@ _failed_fd:
 }
 
 static int
-do_listen(const char * host, int port, int backlog) {
+do_listen(const char * host, int port, int backlog, int reuseport) {
 	int family = 0;
-	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family);
+	int listen_fd = do_bind(host, port, IPPROTO_TCP, &family, reuseport);
 	if (listen_fd < 0) {
 		return -1;
 	}
@@ -1430,12 +2276,18 @@ do_listen(const char * host, int port, int backlog) {
 		close(listen_fd);
 		return -1;
 	}
+	// the poll accepts until EAGAIN
+	sp_nonblocking(listen_fd);
+#ifdef __linux__
+	// inherited by the accepted sockets
+	socket_keepalive(listen_fd);
+#endif
 	return listen_fd;
 }
 
 int 
 socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * addr, int port, int backlog) {
-	int fd = do_listen(addr, port, backlog);
+	int fd = do_listen(addr, port, backlog, ss->reuseport);
 	if (fd < 0) {
 		return -1;
 	}
@@ -1487,6 +2339,101 @@ socket_server_userobject(struct socket_server *ss, struct socket_object_interfac
 	ss->soi = *soi;
 }
 
+void
+socket_server_pause(struct socket_server *ss, int id) {
+	struct socket *s = socket_slot(ss, id);
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id || !s->reading) {
+		return;
+	}
+	if (s->type != SOCKET_TYPE_CONNECTED && s->type != SOCKET_TYPE_HALFCLOSE && s->type != SOCKET_TYPE_BIND) {
+		return;
+	}
+	if (ss->paused_n >= ss->paused_cap) {
+		int cap = ss->paused_cap ? ss->paused_cap * 2 : 64;
+		struct paused_socket *p = MALLOC(cap * sizeof(*p));
+		if (ss->paused_n > 0) {
+			memcpy(p, ss->paused, ss->paused_n * sizeof(*p));
+		}
+		FREE(ss->paused);
+		ss->paused = p;
+		ss->paused_cap = cap;
+	}
+	struct paused_socket *p = &ss->paused[ss->paused_n++];
+	p->id = id;
+	p->opaque = s->opaque;
+	enable_read(ss, s, false);
+}
+
+void
+socket_server_resume(struct socket_server *ss, uintptr_t opaque) {
+	struct request_package request;
+	request.u.resume.opaque = opaque;
+	send_request(ss, &request, 'R', sizeof(request.u.resume));
+}
+
+int
+socket_server_listenstat(struct socket_server *ss, int id, struct socket_listen_stat *stat) {
+	struct socket *s = socket_slot(ss, id);
+	if (s->id != id || s->type != SOCKET_TYPE_LISTEN) {
+		return 1;
+	}
+	// the counters are changed by the socket thread, read them without lock
+	stat->accepted = s->p.listen.accepted;
+	stat->dropped = s->p.listen.dropped;
+	uint32_t now = (uint32_t)time(NULL);
+	uint32_t second = s->p.listen.second;
+	if (now == second) {
+		stat->rate = s->p.listen.last_n;
+	} else if (now == second + 1) {
+		stat->rate = s->p.listen.second_n;
+	} else {
+		stat->rate = 0;
+	}
+	stat->backlog = -1;
+	stat->backlog_max = -1;
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && s->id == id) {
+		// for a listening socket, unacked is the length of accept queue, and sacked is the backlog
+		stat->backlog = info.tcpi_unacked;
+		stat->backlog_max = info.tcpi_sacked;
+	}
+#endif
+	return 0;
+}
+
+void
+socket_server_acceptaddr(struct socket_server *ss, int enable) {
+	ss->accept_addr = enable;
+}
+
+void
+socket_server_readbudget(struct socket_server *ss, int bytes) {
+	ss->read_budget = bytes;
+}
+
+void
+socket_server_idmask(struct socket_server *ss, int mask) {
+	assert((unsigned)mask >= ss->slot_mask);
+	ss->id_mask = mask;
+}
+
+void
+socket_server_maxsocket(struct socket_server *ss, int n) {
+	assert(ss->alloc_id == 0);
+	int bits = MIN_SOCKET_P;
+	while (bits < MAX_SOCKET_P && (1 << bits) < n) {
+		++bits;
+	}
+	ss->slot_mask = (1u << bits) - 1;
+}
+
+void
+socket_server_reuseport(struct socket_server *ss, int enable) {
+	ss->reuseport = enable;
+}
+
 // UDP
 
 int 
@@ -1495,7 +2442,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	int family;
 	if (port != 0 || addr != NULL) {
 		// bind
-		fd = do_bind(addr, port, IPPROTO_UDP, &family);
+		fd = do_bind(addr, port, IPPROTO_UDP, &family, 0);
 		if (fd < 0) {
 			return -1;
 		}
@@ -1525,7 +2472,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 
 int64_t 
 socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp_address *addr, const void *buffer, int sz) {
-	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket * s = socket_slot(ss, id);
 	if (s->id != id || s->type == SOCKET_TYPE_INVALID) {
 		free_buffer(ss, buffer, sz);
 		return -1;
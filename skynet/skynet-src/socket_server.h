@@ -39,6 +39,20 @@ int socket_server_bind(struct socket_server *, uintptr_t opaque, int fd);
 
 // for tcp
 void socket_server_nodelay(struct socket_server *, int id);
+struct socket_listen_stat {
+	uint64_t accepted;
+	uint64_t dropped;	// accepted but closed (no socket slot), or accept failed (EMFILE/ENFILE)
+	int rate;	// accepted in the last second
+	int backlog;	// connections in the accept queue, -1 if unknown
+	int backlog_max;
+};
+
+// return 0 when id is a listening socket
+int socket_server_listenstat(struct socket_server *, int id, struct socket_listen_stat *);
+// stop reading the socket, only the thread polling the socket server can call it
+void socket_server_pause(struct socket_server *, int id);
+// resume reading the sockets paused when their owner is opaque
+void socket_server_resume(struct socket_server *, uintptr_t opaque);
 
 struct socket_udp_address;
 
@@ -62,4 +76,17 @@ struct socket_object_interface {
 // if you send package sz == -1, use soi.
 void socket_server_userobject(struct socket_server *, struct socket_object_interface *soi);
 
+// the data of SOCKET_DATA and SOCKET_UDP comes from a buffer pool, free it by socket_server_buffer_free
+void socket_server_buffer_free(void * buffer);
+// keep reading a readable socket until EAGAIN or bytes read, and report them in one SOCKET_DATA. 0 (default) turns it off
+void socket_server_readbudget(struct socket_server *, int bytes);
+// format the peer address of the accepted socket, default is 1. The address of SOCKET_ACCEPT is NULL when it's 0
+void socket_server_acceptaddr(struct socket_server *, int enable);
+// the max sockets (rounded up to power of 2, 2^16 to 2^24), default is 65536. Call it before any socket is opened
+void socket_server_maxsocket(struct socket_server *, int n);
+// the ids are in [0, mask], default is 0x7fffffff. It should be not less than the max sockets - 1
+void socket_server_idmask(struct socket_server *, int mask);
+// set SO_REUSEPORT on the listening sockets, so more than one socket server can listen the same port
+void socket_server_reuseport(struct socket_server *, int enable);
+
 #endif
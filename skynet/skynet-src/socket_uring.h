@@ -0,0 +1,348 @@
+#ifndef poll_socket_uring_h
+#define poll_socket_uring_h
+
+/*
+	io_uring backend, build with -DUSE_IO_URING (linux 5.5+).
+
+	The interest of each fd is an one-shot IORING_OP_POLL_ADD, so it's level-triggered like the epoll backend :
+	a poll completed is armed again in the next sp_wait. Adding, modifying, removing and re-arming the polls
+	only queue SQEs, and all of them are submitted by the single io_uring_enter in sp_wait,
+	instead of one epoll_ctl for each change.
+
+	The user_data of a poll is (generation << 32 | fd), the generation changes when the interest of the fd
+	changes, so the completions of the stale polls are dropped.
+ */
+
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+#define URING_SQ_SIZE 1024
+#define URING_CQ_SIZE 16384
+#define URING_IGNORE ((uint64_t)-1)
+#define URING_TIMEOUT ((uint64_t)-2)
+
+struct uring_fd {
+	void * ud;
+	uint32_t gen;
+	uint16_t events;
+	uint8_t used;
+	uint8_t armed;	// 0 : completed (and it will be armed in next sp_wait), or no events
+};
+
+struct uring {
+	int fd;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local;	// tail not submitted yet
+	unsigned sq_submit;	// tail submitted
+	unsigned cq_mask;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	struct uring_fd *fds;
+	int fd_cap;
+	int *rearm;
+	int rearm_n;
+	int rearm_cap;
+	struct __kernel_timespec ts;
+};
+
+typedef struct uring * poll_fd;
+
+static bool
+sp_invalid(poll_fd u) {
+	return u == NULL;
+}
+
+static void
+uring_unmap(struct uring *u) {
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_sz);
+}
+
+static poll_fd
+sp_create() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_SIZE;
+	int fd = syscall(__NR_io_uring_setup, URING_SQ_SIZE, &p);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct uring *u = skynet_malloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED
+		|| !(p.features & IORING_FEAT_NODROP)) {
+		uring_unmap(u);
+		close(fd);
+		skynet_free(u);
+		return NULL;
+	}
+	char *sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_local = u->sq_submit = *u->sq_tail;
+	char *cq = u->cq_ring;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return u;
+}
+
+static void
+sp_release(poll_fd u) {
+	uring_unmap(u);
+	close(u->fd);
+	skynet_free(u->fds);
+	skynet_free(u->rearm);
+	skynet_free(u);
+}
+
+static int
+uring_enter(struct uring *u, unsigned wait, unsigned flags) {
+	unsigned n = u->sq_local - u->sq_submit;
+	__atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+	int r = syscall(__NR_io_uring_enter, u->fd, n, wait, flags, NULL, 0);
+	if (r >= 0) {
+		u->sq_submit += r;
+	}
+	return r;
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *u) {
+	while (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		// submission queue is full, submit them now
+		if (uring_enter(u, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			return NULL;
+		}
+	}
+	unsigned idx = u->sq_local & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	++u->sq_local;
+	return sqe;
+}
+
+static inline uint64_t
+uring_data(struct uring *u, int sock) {
+	return (uint64_t)u->fds[sock].gen << 32 | (uint32_t)sock;
+}
+
+static int
+uring_poll(struct uring *u, int sock) {
+	struct io_uring_sqe *sqe = uring_sqe(u);
+	if (sqe == NULL)
+		return 1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sock;
+	sqe->poll32_events = u->fds[sock].events;
+	sqe->user_data = uring_data(u, sock);
+	u->fds[sock].armed = 1;
+	return 0;
+}
+
+// remove the poll armed, and the completions of it become stale
+static void
+uring_cancel(struct uring *u, int sock) {
+	struct uring_fd *f = &u->fds[sock];
+	if (f->armed) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe) {
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = uring_data(u, sock);
+			sqe->user_data = URING_IGNORE;
+		}
+		f->armed = 0;
+	}
+	++f->gen;
+}
+
+static int
+sp_add(poll_fd u, int sock, void *ud) {
+	if (sock >= u->fd_cap) {
+		int cap = u->fd_cap ? u->fd_cap : 1024;
+		while (cap <= sock)
+			cap *= 2;
+		struct uring_fd *fds = skynet_realloc(u->fds, cap * sizeof(*fds));
+		memset(fds + u->fd_cap, 0, (cap - u->fd_cap) * sizeof(*fds));
+		u->fds = fds;
+		u->fd_cap = cap;
+	}
+	struct uring_fd *f = &u->fds[sock];
+	uring_cancel(u, sock);
+	f->ud = ud;
+	f->used = 1;
+	f->events = POLLIN;
+	return uring_poll(u, sock);
+}
+
+static void
+sp_del(poll_fd u, int sock) {
+	if (sock < u->fd_cap && u->fds[sock].used) {
+		uring_cancel(u, sock);
+		u->fds[sock].used = 0;
+		u->fds[sock].ud = NULL;
+	}
+}
+
+static void
+sp_enable(poll_fd u, int sock, void *ud, bool read_enable, bool write_enable) {
+	if (sock >= u->fd_cap || !u->fds[sock].used)
+		return;
+	struct uring_fd *f = &u->fds[sock];
+	uint16_t events = (read_enable ? POLLIN : 0) | (write_enable ? POLLOUT : 0);
+	f->ud = ud;
+	if (f->events == events)
+		return;
+	f->events = events;
+	uring_cancel(u, sock);
+	if (events) {
+		uring_poll(u, sock);
+	}
+}
+
+static int
+sp_wait(poll_fd u, struct event *e, int max, int timeout) {
+	int i;
+	for (i=0;i<u->rearm_n;i++) {
+		int sock = u->rearm[i];
+		struct uring_fd *f = &u->fds[sock];
+		if (f->used && !f->armed && f->events) {
+			uring_poll(u, sock);
+		}
+	}
+	u->rearm_n = 0;
+	if (timeout > 0) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		if (sqe) {
+			u->ts.tv_sec = timeout / 1000;
+			u->ts.tv_nsec = (timeout % 1000) * 1000000;
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uint64_t)(uintptr_t)&u->ts;
+			sqe->len = 1;
+			sqe->user_data = URING_TIMEOUT;
+		}
+	}
+	int n = 0;
+	int timeup = 0;
+	for (;;) {
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			unsigned overflow = __atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW;
+			unsigned wait = (timeout == 0 || n > 0 || timeup) ? 0 : 1;
+			if (wait || overflow || u->sq_local != u->sq_submit) {
+				if (uring_enter(u, wait, (wait || overflow) ? IORING_ENTER_GETEVENTS : 0) < 0) {
+					if (n > 0)
+						break;
+					return -1;
+				}
+				tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+			}
+			if (head == tail) {
+				if (wait)
+					continue;
+				break;
+			}
+		}
+		while (head != tail && n < max) {
+			struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+			uint64_t data = cqe->user_data;
+			int res = cqe->res;
+			++head;
+			if (data == URING_IGNORE)
+				continue;
+			if (data == URING_TIMEOUT) {
+				// a timer of the former sp_wait may expire here, it's only a spurious wakeup
+				timeup = 1;
+				continue;
+			}
+			int sock = (int)(uint32_t)data;
+			if (sock >= u->fd_cap)
+				continue;
+			struct uring_fd *f = &u->fds[sock];
+			if (!f->used || f->gen != (uint32_t)(data >> 32) || !f->armed)
+				continue;
+			f->armed = 0;
+			if (u->rearm_n >= u->rearm_cap) {
+				u->rearm_cap = u->rearm_cap ? u->rearm_cap * 2 : 64;
+				u->rearm = skynet_realloc(u->rearm, u->rearm_cap * sizeof(int));
+			}
+			u->rearm[u->rearm_n++] = sock;
+			e[n].s = f->ud;
+			// report error and hangup (or a failed poll) as readable, so the read gets the error
+			e[n].read = res < 0 || (res & (POLLIN | POLLERR | POLLHUP)) != 0;
+			e[n].write = res > 0 && (res & POLLOUT) != 0;
+			++n;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		if (n > 0 || timeout == 0 || timeup) {
+			break;
+		}
+	}
+	return n;
+}
+
+static void
+sp_nonblocking(int fd) {
+	int flag = fcntl(fd, F_GETFL, 0);
+	if ( -1 == flag ) {
+		return;
+	}
+
+	fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+}
+
+#endif
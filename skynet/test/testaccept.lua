@@ -0,0 +1,39 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- Accept storm: open many connections at once, and print the counters of the listening socket.
+-- Set `acceptaddr = false` in config to skip formatting the peer address of each connection.
+
+local N = tonumber((...)) or 5000
+local PORT = 8768
+
+skynet.start(function()
+	local listen = socket.listen("127.0.0.1", PORT, 4096)
+	local accepted = {}
+	local n = 0
+	socket.start(listen, function(id, addr)
+		n = n + 1
+		accepted[n] = id
+	end)
+	local start = skynet.now()
+	local ids = {}
+	for i=1,N do
+		ids[i] = assert(socket.open("127.0.0.1", PORT))
+	end
+	while n < N do
+		skynet.sleep(1)
+	end
+	local elapsed = skynet.now() - start
+	local stat = assert(socket.listenstat(listen))
+	print(string.format("%d connections accepted in %.2fs", n, elapsed/100))
+	print(string.format("accepted = %d dropped = %d rate = %d backlog = %d/%d",
+		stat.accepted, stat.dropped, stat.rate, stat.backlog, stat.backlog_max))
+	assert(stat.accepted == N)
+	for i=1,N do
+		socket.close(ids[i])
+		socket.close(accepted[i])
+	end
+	socket.close(listen)
+	skynet.abort()
+end)
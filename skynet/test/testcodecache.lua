@@ -0,0 +1,42 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Launch many identical services, the code is loaded once and cloned by the others (see skynet.cache.stat).
+
+local mode = ...
+
+if mode == "agent" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		skynet.ret()
+		skynet.exit()
+	end)
+end)
+
+else
+
+local N = tonumber(mode) or 1000
+
+skynet.start(function()
+	local before = skynet.cache.stat()
+	local start = skynet.now()
+	local agents = {}
+	for i=1,N do
+		agents[i] = skynet.newservice(SERVICE_NAME, "agent")
+	end
+	local elapsed = skynet.now() - start
+	local mem = skynet.call(agents[1], "debug", "MEM")
+	for i=1,N do
+		skynet.call(agents[i], "lua")
+	end
+	local stat = skynet.cache.stat()
+	local hit = stat.hit - before.hit
+	local miss = stat.miss - before.miss
+	print(string.format("%d services launched in %.2fs, %.0f KB per service", N, elapsed/100, mem))
+	print(string.format("codecache : %d hit, %d miss (%.1f%% hit), %d files %d KB, %d KB cloned",
+		hit, miss, hit * 100 / (hit + miss), stat.entries, stat.size // 1024, (stat.cloned - before.cloned) // 1024))
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,60 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- Echo benchmark: N connections, each one sends a line and waits for the echo, in a loop.
+-- Compare the poll backends : build with and without -DUSE_IO_URING (see Makefile), and compare the round trips/s.
+-- Use `perf stat -e 'syscalls:sys_enter_*'` or `strace -c -f` to compare the syscalls.
+
+local N = tonumber((...)) or 1000
+local DURATION = 500	-- 5s
+local PORT = 8766
+local LINE = string.rep("x", 63)
+
+local running = true
+local count = 0
+
+local function echo(id)
+	socket.start(id)
+	while true do
+		local line = socket.readline(id)
+		if not line then
+			break
+		end
+		socket.write(id, line .. "\n")
+	end
+	socket.close(id)
+end
+
+local function client(id)
+	while running do
+		socket.write(id, LINE .. "\n")
+		if not socket.readline(id) then
+			break
+		end
+		count = count + 1
+	end
+	socket.close(id)
+end
+
+skynet.start(function()
+	local listen = socket.listen("127.0.0.1", PORT, 4096)
+	socket.start(listen, function(id)
+		skynet.fork(echo, id)
+	end)
+	local ids = {}
+	for i=1,N do
+		ids[i] = assert(socket.open("127.0.0.1", PORT))
+	end
+	local start = skynet.now()
+	for i=1,N do
+		skynet.fork(client, ids[i])
+	end
+	skynet.sleep(DURATION)
+	running = false
+	local elapsed = skynet.now() - start
+	print(string.format("%d connections : %d round trips in %.2fs, %.0f round trips/s",
+		N, count, elapsed/100, count * 100 / elapsed))
+	socket.close(listen)
+	skynet.abort()
+end)
@@ -0,0 +1,140 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- Clients flood a server which is busy, the message queue of the server should stay
+-- around the high watermark of socket.flowcontrol, and all the data arrives after it resumes.
+-- An udp socket is paused too : it's flooded without a break, the packages which can't be read are dropped.
+
+local mode = ...
+local PORT = 8767
+local UDP_PORT = 8766
+local HIGH = 64
+local LOW = 16
+local CONNECTION = 100
+local LINE = 100	-- lines per connection
+local DATA = string.rep("x", 63) .. "\n"
+local UDP_PACKAGE = 200000
+
+if mode == "client" then
+
+skynet.start(function()
+	local ids = {}
+	for i=1,CONNECTION do
+		ids[i] = assert(socket.open("127.0.0.1", PORT))
+	end
+	skynet.dispatch("lua", function()
+		-- the server is busy now
+		for i=1,LINE do
+			for _, id in ipairs(ids) do
+				socket.write(id, DATA)
+			end
+			-- wait, so the lines are read and queued as messages one by one
+			skynet.sleep(1)
+		end
+		skynet.exit()
+	end)
+end)
+
+elseif mode == "udpclient" then
+
+skynet.start(function()
+	local id = socket.udp(function() end)
+	socket.udp_connect(id, "127.0.0.1", UDP_PORT)
+	skynet.dispatch("lua", function()
+		-- no sleep, so the socket of the server is never drained
+		for i=1,UDP_PACKAGE do
+			socket.write(id, DATA)
+		end
+		socket.close(id)
+		skynet.exit()
+	end)
+end)
+
+elseif mode == "server" then
+
+local function busy(ms)
+	local t = skynet.now() + ms // 10
+	while skynet.now() < t do
+		for i=1,1000 do end
+	end
+end
+
+local function server(high)
+	socket.flowcontrol(high, LOW)
+	local listen = socket.listen("127.0.0.1", PORT)
+	local peers = {}
+	socket.start(listen, function(id)
+		table.insert(peers, id)
+	end)
+	local client = skynet.newservice(SERVICE_NAME, "client")
+	while #peers < CONNECTION do
+		skynet.sleep(1)
+	end
+	for _, id in ipairs(peers) do
+		socket.start(id)
+	end
+	skynet.send(client, "lua")
+	-- don't dispatch messages for a while, the socket data is queued
+	busy(3000)
+	local mqlen = skynet.mqlen()
+	local n = 0
+	for _, id in ipairs(peers) do
+		for i=1,LINE do
+			assert(socket.readline(id))
+			n = n + 1
+		end
+		socket.close(id)
+	end
+	socket.close(listen)
+	return mqlen, n
+end
+
+local function udpserver(high)
+	socket.flowcontrol(high, LOW)
+	local n = 0
+	local id = socket.udp(function(str, from)
+		n = n + 1
+	end, "127.0.0.1", UDP_PORT)
+	local client = skynet.newservice(SERVICE_NAME, "udpclient")
+	skynet.send(client, "lua")
+	busy(3000)
+	local mqlen = skynet.mqlen()
+	-- resume and read the rest
+	skynet.sleep(100)
+	socket.close(id)
+	return mqlen, n
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, high, udp)
+		if udp then
+			skynet.ret(skynet.pack(udpserver(high)))
+		else
+			skynet.ret(skynet.pack(server(high)))
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	for _, high in ipairs { 0, HIGH } do
+		local s = skynet.newservice(SERVICE_NAME, "server")
+		local mqlen, n = skynet.call(s, "lua", high)
+		print(string.format("flowcontrol high = %d : queue length %d after busy, %d lines received", high, mqlen, n))
+	end
+	for _, high in ipairs { 0, HIGH } do
+		local s = skynet.newservice(SERVICE_NAME, "server")
+		local mqlen, n = skynet.call(s, "lua", high, true)
+		print(string.format("flowcontrol high = %d : queue length %d after busy, %d udp packages received", high, mqlen, n))
+		if high > 0 then
+			-- the rest of a recvmmsg batch is queued after the pause, but no more
+			assert(mqlen < high * 2, "udp socket is not paused")
+			assert(n > 0)
+		end
+	end
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,63 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Handle lookup benchmark: senders spread messages over many sinks, so every send grabs
+-- a different context by handle (skynet_handle_grab) and the queues are rarely contended.
+-- Run it with thread = 1, 2, 4 ... 64 in config to see how it scales.
+
+local mode = ...
+
+if mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, sinks, n)
+		local m = #sinks
+		for i=1,n do
+			skynet.send(sinks[i % m + 1], "lua")
+		end
+		skynet.ret()
+	end)
+end)
+
+elseif mode == "sink" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function() end)
+end)
+
+else
+
+local SENDER = 64
+local SINK = 1024
+local MESSAGE = 10000
+
+skynet.start(function()
+	local sinks = {}
+	for i=1,SINK do
+		sinks[i] = skynet.newservice(SERVICE_NAME, "sink")
+	end
+	local senders = {}
+	for i=1,SENDER do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local start = skynet.now()
+	local n = SENDER
+	local co = coroutine.running()
+	for i=1,SENDER do
+		skynet.fork(function()
+			skynet.call(senders[i], "lua", sinks, MESSAGE)
+			n = n - 1
+			if n == 0 then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	local elapsed = skynet.now() - start
+	local total = SENDER * MESSAGE
+	print(string.format("thread = %s : %d sends in %.2fs, %.0f grab/s",
+		skynet.getenv "thread", total, elapsed/100, total * 100 / elapsed))
+	skynet.abort()
+end)
+
+end
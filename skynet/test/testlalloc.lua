@@ -0,0 +1,28 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Lua allocator benchmark: table/closure/string churn, the garbage collector is busy.
+-- Run it with and without `luaslab = true` in config to compare the allocators.
+
+local ROUND = tonumber((...)) or 200000
+
+local function churn(n)
+	local live = {}
+	for i=1,n do
+		local t = { id = i, name = "obj" .. (i % 1000), pos = { x = i, y = -i } }
+		t.f = function() return t.id end
+		live[i % 1024 + 1] = t	-- keep some of them alive for a while
+	end
+	return live
+end
+
+skynet.start(function()
+	churn(1000)	-- warm up
+	collectgarbage "collect"
+	local start = os.clock()
+	churn(ROUND)
+	local elapsed = os.clock() - start
+	print(string.format("luaslab = %s : %d objects in %.2fs, %.0f objects/s, %.0f KB lua memory",
+		skynet.getenv "luaslab", ROUND, elapsed, ROUND / elapsed, collectgarbage "count"))
+	skynet.abort()
+end)
@@ -0,0 +1,53 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- Open many connections at once, so the socket slot table grows page by page.
+-- Each connection takes two sockets (both ends are in this process), raise `ulimit -n` first.
+-- Set `maxsocket` in config for more than 65536 sockets per socket thread.
+
+local N = tonumber((...)) or 8000
+local ROUND = 2
+local PORT = 8765
+
+local function echo(id)
+	socket.start(id)
+	while true do
+		local line = socket.readline(id)
+		if not line then
+			break
+		end
+		socket.write(id, line .. "\n")
+	end
+	socket.close(id)
+end
+
+skynet.start(function()
+	local listen = socket.listen("127.0.0.1", PORT, 4096)
+	socket.start(listen, function(id)
+		skynet.fork(echo, id)
+	end)
+	for round = 1, ROUND do
+		local start = skynet.now()
+		local ids = {}
+		local seen = {}
+		for i=1,N do
+			local id = assert(socket.open("127.0.0.1", PORT))
+			assert(not seen[id], "duplicate id")
+			seen[id] = true
+			ids[i] = id
+		end
+		for i=1,N do
+			socket.write(ids[i], tostring(i) .. "\n")
+		end
+		for i=1,N do
+			assert(socket.readline(ids[i]) == tostring(i))
+		end
+		for i=1,N do
+			socket.close(ids[i])
+		end
+		print(string.format("round %d : %d connections echoed in %.2fs", round, N, (skynet.now() - start)/100))
+	end
+	socket.close(listen)
+	skynet.abort()
+end)
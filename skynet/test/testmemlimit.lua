@@ -0,0 +1,43 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- A leaking service with skynet.memlimit : the allocation fails with "not enough memory",
+-- the service is still alive, and the node is not affected.
+
+local mode = ...
+
+if mode == "leak" then
+
+skynet.memlimit(8 * 1024 * 1024)
+assert(skynet.gcmode("incremental", 200, 200) == "incremental")
+
+local leak = {}
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "leak" then
+			while true do
+				table.insert(leak, string.rep("x", 1024) .. #leak)
+			end
+		elseif cmd == "free" then
+			leak = {}
+			collectgarbage "collect"
+			skynet.ret(skynet.pack(collectgarbage "count"))
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local s = skynet.newservice(SERVICE_NAME, "leak")
+	local ok, err = pcall(skynet.call, s, "lua", "leak")
+	assert(not ok)
+	print("leak :", err)
+	local kb = skynet.call(s, "lua", "free")
+	print(string.format("free : %.0f KB", kb))
+	skynet.sleep(10)	-- wait for the error log
+	skynet.abort()
+end)
+
+end
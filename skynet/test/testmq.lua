@@ -0,0 +1,67 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Message queue contention benchmark: many producers flood one consumer.
+-- Build with and without -DUSE_LOCKFREE_MQ (see Makefile), and compare the msg/s.
+
+local mode = ...
+
+if mode == "producer" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, sink, n)
+		for i=1,n do
+			skynet.send(sink, "lua", i)
+		end
+		skynet.ret()
+	end)
+end)
+
+elseif mode == "sink" then
+
+local count = 0
+local total
+local waiting
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, _, cmd)
+		if session == 0 then
+			count = count + 1
+			if count == total then
+				skynet.wakeup(waiting)
+			end
+		else
+			-- cmd is the expected total
+			total = cmd
+			waiting = coroutine.running()
+			if count < total then
+				skynet.wait()
+			end
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+end)
+
+else
+
+local PRODUCER = 32
+local MESSAGE = 100000
+
+skynet.start(function()
+	local sink = skynet.newservice(SERVICE_NAME, "sink")
+	local producers = {}
+	for i=1,PRODUCER do
+		producers[i] = skynet.newservice(SERVICE_NAME, "producer")
+	end
+	local start = skynet.now()
+	for i=1,PRODUCER do
+		skynet.fork(skynet.call, producers[i], "lua", sink, MESSAGE)
+	end
+	local count = skynet.call(sink, "lua", PRODUCER * MESSAGE)
+	local elapsed = skynet.now() - start
+	print(string.format("thread = %s : %d producers, %d messages in %.2fs, %.0f msg/s",
+		skynet.getenv "thread", PRODUCER, count, elapsed/100, count * 100 / elapsed))
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,33 @@
+local skynet = require "skynet"
+
+-- Need msgstat = true in config
+
+local mode = ...
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n)
+		local s = 0
+		for i=1,n do
+			s = s + i
+		end
+		skynet.ret(skynet.pack(s))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local slave = skynet.newservice(SERVICE_NAME, "slave")
+	for i=1,1000 do
+		skynet.call(slave, "lua", i * 100)
+	end
+	local stat = skynet.call(slave, "debug", "MSGSTAT")
+	for _, k in ipairs { "count", "count.lua", "wait.50", "wait.99", "wait.max", "exec.50", "exec.99", "exec.max" } do
+		print(k, stat[k])
+	end
+	skynet.exit()
+end)
+
+end
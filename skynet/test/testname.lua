@@ -0,0 +1,59 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.register, skynet.abort
+
+-- Local name (".name") sending: correctness after a name is rebound, and the cost compared with a handle.
+
+local mode = ...
+
+if mode == "slave" then
+
+local count = 0
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, _, cmd)
+		if cmd == "count" then
+			skynet.ret(skynet.pack(count, skynet.self()))
+		else
+			count = count + 1
+		end
+	end)
+end)
+
+else
+
+local N = 200000
+local ROUND = 500	-- call after each round, keep the queue short
+
+local function bench(addr)
+	local start = skynet.now()
+	for i=1,N,ROUND do
+		for j=1,ROUND do
+			skynet.send(addr, "lua", "inc")
+		end
+		skynet.call(addr, "lua", "count")
+	end
+	return skynet.now() - start
+end
+
+skynet.start(function()
+	local a = skynet.newservice(SERVICE_NAME, "slave")
+	skynet.name(".testname", a)
+	skynet.send(".testname", "lua", "inc")
+	local count, handle = skynet.call(".testname", "lua", "count")
+	assert(count == 1 and handle == a)
+
+	-- rebind the name to another service, the cached binding must be dropped
+	skynet.kill(a)
+	local b = skynet.newservice(SERVICE_NAME, "slave")
+	skynet.name(".testname", b)
+	skynet.send(".testname", "lua", "inc")
+	count, handle = skynet.call(".testname", "lua", "count")
+	assert(count == 1 and handle == b, "stale name binding")
+
+	local ti_handle = bench(b)
+	local ti_name = bench(".testname")
+	print(string.format("send %d : by handle %.2fs, by name %.2fs", N, ti_handle/100, ti_name/100))
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,104 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Serialization benchmark: pack and unpack arrays of records (2~20K bytes per message), report MB/s.
+-- packref packs the repeated keys as references, compare the size and speed with pack.
+
+local ROUND = tonumber((...)) or 2000
+
+local function record(i)
+	return {
+		uid = 100000 + i,
+		level = i % 100,
+		name = "player" .. i,
+		online = i % 2 == 0,
+		pos = { x = i * 1.5, y = -i, z = 0 },
+		items = { 1001, 1002, 1003, i },
+	}
+end
+
+local function records(n)
+	local t = {}
+	for i=1,n do
+		t[i] = record(i)
+	end
+	return t
+end
+
+local function compare(a, b)
+	if type(a) ~= "table" then
+		assert(a == b)
+		return
+	end
+	for k,v in pairs(a) do
+		compare(v, b[k])
+	end
+	for k in pairs(b) do
+		assert(a[k] ~= nil)
+	end
+end
+
+local function bench(name, n)
+	local msg = records(n)
+	local _, sz = skynet.pack(msg)
+	local pmsg, psz = skynet.pack(msg)
+	compare(msg, skynet.unpack(pmsg, psz))
+	skynet.trash(pmsg, psz)
+	local rmsg, rsz = skynet.packref(msg)
+	compare(msg, skynet.unpack(rmsg, rsz))
+	skynet.trash(rmsg, rsz)
+
+	local start = os.clock()
+	for i=1,ROUND do
+		local p, s = skynet.pack("cmd", msg)
+		skynet.trash(p, s)
+	end
+	local pack_time = os.clock() - start
+
+	start = os.clock()
+	for i=1,ROUND do
+		local str = skynet.packstring("cmd", msg)
+	end
+	local packstring_time = os.clock() - start
+
+	local str = skynet.packstring("cmd", msg)
+	start = os.clock()
+	for i=1,ROUND do
+		skynet.unpack(str)
+	end
+	local unpack_time = os.clock() - start
+
+	start = os.clock()
+	for i=1,ROUND do
+		local p, s = skynet.packref("cmd", msg)
+		skynet.trash(p, s)
+	end
+	local packref_time = os.clock() - start
+
+	local mb = sz * ROUND / (1024 * 1024)
+	print(string.format("%-6s %6d bytes : pack %.1f MB/s, packstring %.1f MB/s, unpack %.1f MB/s",
+		name, sz, mb / pack_time, mb / packstring_time, mb / unpack_time))
+	print(string.format("%-6s %6d bytes (packref) : %.1f MB/s (of the pack size)", name, rsz, mb / packref_time))
+end
+
+local function test_ref()
+	-- more than MAX_COOKIE-1 and MAX_STRING_REF (256) different strings, each one repeated
+	local t = {}
+	for i=1,300 do
+		local k = "key" .. i
+		t[i] = { [k] = k, name = "name" .. (i % 40), x = "", y = "y" }
+	end
+	local msg, sz = skynet.packref(t, "key1", "key299", "name1")
+	local r, k1, k299, n1 = skynet.unpack(msg, sz)
+	skynet.trash(msg, sz)
+	compare(t, r)
+	assert(k1 == "key1" and k299 == "key299" and n1 == "name1")
+end
+
+skynet.start(function()
+	test_ref()
+	bench("small", 20)
+	bench("medium", 80)
+	bench("large", 200)
+	skynet.abort()
+end)
@@ -0,0 +1,62 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Worker parking benchmark:
+-- 1. CPU usage of the whole process when the node is idle.
+-- 2. The wake-to-dispatch latency (queue wait time) of a burst, need msgstat = true in config.
+
+local mode = ...
+
+if mode == "slave" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function() end)
+end)
+
+else
+
+local SLAVE = 64
+local BURST = 20
+
+skynet.start(function()
+	local slaves = {}
+	for i=1,SLAVE do
+		slaves[i] = skynet.newservice(SERVICE_NAME, "slave")
+	end
+
+	-- os.clock() is the cpu time of the process (all threads)
+	local clock = os.clock()
+	skynet.sleep(500)
+	print(string.format("thread = %s spin = %s : idle cpu %.2f%%",
+		skynet.getenv "thread", skynet.getenv "spin", (os.clock() - clock) / 5 * 100))
+
+	if not skynet.stat "count" then
+		print("Set msgstat = true in config to measure the burst latency")
+		skynet.abort()
+		return
+	end
+
+	for i=1,SLAVE do
+		skynet.call(slaves[i], "debug", "MSGSTAT", true)	-- reset
+	end
+	for n=1,BURST do
+		-- let workers park
+		skynet.sleep(10)
+		for i=1,SLAVE do
+			skynet.send(slaves[i], "lua")
+		end
+	end
+	skynet.sleep(10)
+	local p50, p99, max = 0, 0, 0
+	for i=1,SLAVE do
+		local stat = skynet.call(slaves[i], "debug", "MSGSTAT")
+		p50 = p50 + stat["wait.50"]
+		p99 = math.max(p99, stat["wait.99"])
+		max = math.max(max, stat["wait.max"])
+	end
+	print(string.format("burst of %d messages : wait p50 %.1fus, p99 %.1fus, max %.1fus",
+		SLAVE, p50 / SLAVE, p99, max))
+	skynet.abort()
+end)
+
+end
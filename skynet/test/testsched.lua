@@ -0,0 +1,77 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Scheduler benchmark: many service pairs bounce messages to each other,
+-- so each message costs one push/pop of the run queue.
+-- Run it with different `thread` (and `worksteal = true`) in config to see how it scales.
+
+local mode = ...
+
+if mode == "pingpong" then
+
+local count = 0
+local running = true
+
+local CMD = {}
+
+function CMD.ping(source)
+	count = count + 1
+	if running then
+		skynet.send(source, "lua", "ping")
+	end
+end
+
+function CMD.start(source, target, inflight)
+	for i=1,inflight do
+		skynet.send(target, "lua", "ping")
+	end
+end
+
+function CMD.stop(source)
+	running = false
+end
+
+function CMD.count(source)
+	skynet.ret(skynet.pack(count))
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, source, cmd, ...)
+		CMD[cmd](source, ...)
+	end)
+end)
+
+else
+
+local PAIRS = 256
+local INFLIGHT = 4
+local IDLE = 1000	-- idle services, only make the handle table larger
+local DURATION = 500	-- 5s
+
+skynet.start(function()
+	for i=1,IDLE do
+		skynet.newservice(SERVICE_NAME, "pingpong")
+	end
+	local services = {}
+	for i=1,PAIRS*2 do
+		services[i] = skynet.newservice(SERVICE_NAME, "pingpong")
+	end
+	local start = skynet.now()
+	for i=1,PAIRS*2,2 do
+		skynet.send(services[i], "lua", "start", services[i+1], INFLIGHT)
+	end
+	skynet.sleep(DURATION)
+	for _, s in ipairs(services) do
+		skynet.send(s, "lua", "stop")
+	end
+	local elapsed = skynet.now() - start
+	local total = 0
+	for _, s in ipairs(services) do
+		total = total + skynet.call(s, "lua", "count")
+	end
+	print(string.format("thread = %s worksteal = %s : %d messages in %.2fs, %.0f msg/s",
+		skynet.getenv "thread", skynet.getenv "worksteal", total, elapsed/100, total * 100 / elapsed))
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,98 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- Socket sharding: run it with `socket_thread = 4` in config, with and without `reuseport = true`.
+-- The low bits of a socket id are the shard. Connections spread to the shards in turn; accepted
+-- sockets are in shard 0 without reuseport, or in any shard of the listen group with reuseport.
+
+local N = tonumber((...)) or 64
+local PORT = 8769
+
+local shards = tonumber(skynet.getenv "socket_thread") or 1
+local reuseport = skynet.getenv "reuseport" == "true" and shards > 1
+local bits = 0
+while (1 << bits) < shards do
+	bits = bits + 1
+end
+
+local function shard(id)
+	return id & ((1 << bits) - 1)
+end
+
+local function distribution(ids)
+	local count = {}
+	for i=0,shards-1 do
+		count[i+1] = 0
+	end
+	for _, id in ipairs(ids) do
+		local s = shard(id)
+		assert(s < shards, "invalid shard")
+		count[s+1] = count[s+1] + 1
+	end
+	return count
+end
+
+skynet.start(function()
+	local listen = assert(socket.listen("127.0.0.1", PORT, 1024))
+	assert(shard(listen) == 0)
+	local accepted = {}
+	socket.start(listen, function(id)
+		table.insert(accepted, id)
+	end)
+
+	local clients = {}
+	for i=1,N do
+		clients[i] = assert(socket.open("127.0.0.1", PORT))
+	end
+	while #accepted < N do
+		skynet.sleep(1)
+	end
+
+	local c = distribution(clients)
+	local a = distribution(accepted)
+	print(string.format("socket_thread = %d reuseport = %s : connect %s, accept %s",
+		shards, reuseport, table.concat(c, "/"), table.concat(a, "/")))
+	for i=1,shards do
+		-- connections are spread in turn
+		assert(c[i] >= N // shards, "connect is not spread")
+	end
+	if not reuseport then
+		assert(a[1] == N, "accepted sockets should be in shard 0")
+	end
+	local stat = assert(socket.listenstat(listen))
+	assert(stat.accepted == N)
+
+	-- send by id : server -> client, then client -> server
+	for i, id in ipairs(accepted) do
+		socket.start(id)
+		socket.write(id, tostring(id) .. "\n")
+	end
+	local peer = {}
+	for i, id in ipairs(clients) do
+		local line = assert(socket.readline(id))
+		local sid = tonumber(line)
+		peer[sid] = id
+		socket.write(id, line .. "\n")
+	end
+	for _, id in ipairs(accepted) do
+		assert(socket.readline(id) == tostring(id))
+	end
+
+	-- close by id : the peer sees the close
+	for i, id in ipairs(accepted) do
+		socket.close(id)
+		assert(not socket.readline(peer[id]))
+		socket.close(peer[id])
+	end
+
+	-- closing the listen group closes the listening sockets in all the shards
+	socket.close(listen)
+	skynet.sleep(10)
+	for i=1,shards * 2 do
+		local id = socket.open("127.0.0.1", PORT)
+		assert(id == nil, "listen socket is still open")
+	end
+	print("ok")
+	skynet.abort()
+end)
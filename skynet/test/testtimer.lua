@@ -19,8 +19,23 @@ local function test()
 	end
 end
 
+local function test_cancel()
+	local id = skynet.timeout(10, function() error "cancelled timer fired" end)
+	assert(skynet.untimeout(id))
+	assert(not skynet.untimeout(id))
+	-- 0.5 is 5ms when tick is less than 10ms (see tick in config)
+	local t = skynet.now()
+	for i=1,10 do
+		skynet.sleep(0.5)
+	end
+	print("test sleep 0.5 * 10", skynet.now() - t)
+	skynet.sleep(20)
+	print("test untimeout ok")
+end
+
 skynet.start(function()
 	test()
+	test_cancel()
 
 	skynet.fork(wakeup, coroutine.running())
 	skynet.timeout(300, function() timeout "Hello World" end)
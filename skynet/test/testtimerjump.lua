@@ -0,0 +1,53 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.abort
+
+-- Simulate a large clock jump: stop the whole process (SIGSTOP) for a few seconds,
+-- so the timer thread must catch up all the elapsed ticks at once after SIGCONT.
+-- All the overdue timers should fire in order, and the later timers must not fire early.
+-- Try it with tick = 1 and timerfd = true in config.
+
+local OVERDUE = 1000
+local LATER = 100
+local STOP = 5	-- seconds
+
+local function getpid()
+	local f = assert(io.open "/proc/self/stat")
+	local pid = f:read "n"
+	f:close()
+	return pid
+end
+
+skynet.start(function()
+	local fired = {}
+	local early = 0
+	for i=1,OVERDUE do
+		local ti = 100 + i % 300
+		local deadline = skynet.now() + ti
+		skynet.timeout(ti, function()
+			table.insert(fired, deadline)
+		end)
+	end
+	for i=1,LATER do
+		local ti = (STOP + 1) * 100 + i
+		local deadline = skynet.now() + ti
+		skynet.timeout(ti, function()
+			if skynet.now() < deadline then
+				early = early + 1
+			end
+			table.insert(fired, deadline)
+		end)
+	end
+
+	local pid = getpid()
+	os.execute(string.format("(kill -STOP %d; sleep %d; kill -CONT %d) &", pid, STOP, pid))
+
+	skynet.sleep((STOP + 3) * 100)
+	assert(#fired == OVERDUE + LATER, #fired)
+	for i=2,#fired do
+		-- skynet.now() is centisecond, the deadline may be 1cs later
+		assert(fired[i-1] <= fired[i] + 1, "timer out of order")
+	end
+	assert(early == 0, "timer fires early")
+	print(string.format("tick = %s : %d timers ok after a %ds jump", skynet.getenv "tick", #fired, STOP))
+	skynet.abort()
+end)
@@ -0,0 +1,71 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- UDP throughput benchmark: the senders blast small datagrams to one udp socket,
+-- and report how many packets per second are received (and lost).
+
+local mode = ...
+
+local PORT = 18883
+local PACKET = 32
+local SENDER = 4
+local COUNT = 100000	-- packets per sender
+local BURST = 100	-- yield every BURST packets, or the kernel buffer drops most of them
+
+if mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local u = socket.udp(function() end)
+		socket.udp_connect(u, "127.0.0.1", PORT)
+		local pack = string.rep("x", PACKET)
+		for i=1,COUNT do
+			socket.write(u, pack)
+			if i % BURST == 0 then
+				skynet.yield()
+			end
+		end
+		socket.close(u)
+		skynet.ret()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local count = 0
+	local last
+	local u = socket.udp(function(str, from)
+		count = count + 1
+		last = skynet.now()
+	end, "127.0.0.1", PORT)
+	local senders = {}
+	for i=1,SENDER do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local start = skynet.now()
+	local done = 0
+	for i=1,SENDER do
+		skynet.fork(function()
+			skynet.call(senders[i], "lua")
+			done = done + 1
+		end)
+	end
+	while done < SENDER do
+		skynet.sleep(10)
+	end
+	-- wait the last packages
+	repeat
+		local n = count
+		skynet.sleep(20)
+	until n == count
+	local elapsed = ((last or skynet.now()) - start) / 100
+	local total = SENDER * COUNT
+	print(string.format("%d packets sent, %d received (%.1f%% lost) in %.2fs : %.0f pps",
+		total, count, (total - count) * 100 / total, elapsed, count / elapsed))
+	socket.close(u)
+	skynet.abort()
+end)
+
+end
@@ -0,0 +1,62 @@
+local skynet = require "skynet"
+local socket = require "socket"
+require "skynet.manager"	-- import skynet.abort
+
+-- Socket write benchmark: many small packets are sent to one connection before the peer reads,
+-- so the send list of the socket grows long and is flushed by the socket thread.
+-- It reports packets/s, MB/s and write syscalls/s (syscw in /proc/self/io, linux only) of the flush.
+
+local PORT = 18887
+local PACKET = 64
+local COUNT = 500000
+
+local function syscw()
+	local f = io.open "/proc/self/io"
+	if not f then
+		return 0
+	end
+	local c = f:read "a"
+	f:close()
+	return tonumber(c:match "syscw:%s*(%d+)") or 0
+end
+
+skynet.start(function()
+	local total = PACKET * COUNT
+	local lid = socket.listen("127.0.0.1", PORT)
+	local co = coroutine.running()
+	local peer
+	local waiting
+	socket.start(lid, function(id)
+		peer = id
+		if waiting then
+			skynet.wakeup(co)
+		end
+	end)
+	local c = socket.open("127.0.0.1", PORT)
+	if not peer then
+		waiting = true
+		skynet.wait()
+	end
+
+	local pack = string.rep("x", PACKET)
+	for i=1,COUNT do
+		socket.write(c, pack)
+	end
+	-- start reading after all the packets are queued, and measure how the send list is flushed
+	local start = skynet.now()
+	local w = syscw()
+	socket.start(peer)
+	local n = 0
+	while n < total do
+		local data = socket.read(peer)
+		n = n + #data
+	end
+	local elapsed = (skynet.now() - start) / 100
+	w = syscw() - w
+	print(string.format("%d packets (%d bytes) in %.2fs : %.0f packets/s, %.2f MB/s, %d write syscalls, %.0f syscalls/s",
+		COUNT, n, elapsed, COUNT / elapsed, n / elapsed / (1024*1024), w, w / elapsed))
+	socket.close(c)
+	socket.close(peer)
+	socket.close(lid)
+	skynet.abort()
+end)